@@ -75,12 +75,38 @@ MOSH_FCGI::Manager effectively runs an infinite loop (which can be terminated
 through POSIX signals or a function call from another thread) that passes
 control to requests that have a message queued for the transceiver. It is smart
 enough to go into a sleep mode when there are no tasks to complete or data to
-receive.
-
-MOFH_FCGI::Transceiver's transmit half implements a ring buffer that can grow
-indefinitely to ensure that operation does not halt. The send half receives full
-frames and passes them through MOSH_FCGI::Manager onto the requests. It manages
-all the open connections and polls them for incoming data.
+receive. Given a pool size, it keeps finished requests and hands them out again
+after a call to MOSH_FCGI::Request_base::reset(), instead of allocating each one
+afresh.
+
+With a C++20 compiler, a request can also be written as a coroutine deriving
+MOSH_FCGI::Coro_request, which awaits stdin, timers, messages from other threads
+and the draining of its output instead of reacting to each record; see
+examples/coro.
+
+A single MOSH_FCGI::Manager runs in a single thread, unless it's given worker
+threads to run requests in; its own thread then does nothing but I/O, so a slow
+response holds up no one else. To use more cores, several managers can also run
+side by side in a MOSH_FCGI::ShardsT, each in a thread pinned to a core of its own.
+They either share one listening socket, or each listen on a socket of their own
+bound with @c SO_REUSEPORT.
+
+A new build can take over from a running one without refusing a connection:
+MOSH_FCGI::Manager::hand_off() passes the listening socket and idle connections to
+the new process over a Unix socket (see MOSH_FCGI::handoff), after which the old
+one finishes the requests it has in flight and returns from handler().
+
+MOSH_FCGI::Transceiver's transmit half buffers each connection's output in
+chunks and sends it as the connection takes it. With
+MOSH_FCGI::Transceiver::Options::high_water set, a connection holding more than
+that much unsent output is read from no more until it is down to the low water
+mark, and requests writing to it from worker threads are held up in
+MOSH_FCGI::Transceiver::throttle() meanwhile; a connection that takes nothing for
+@c send_timeout is dropped. Requests run on the I/O thread aren't held up, as that
+would stall every other connection. Without a high water mark, the buffer grows
+as far as the requests write. The receive half takes in full frames and passes
+them through MOSH_FCGI::Manager onto the requests. It manages all the open
+connections and polls them for incoming data.
 
 @section dep Dependencies
 
@@ -478,18 +504,13 @@ would be built by whatever is calling the callback, but this is just a simple
 example. A @c type of @c 0 means a FastCGI record and is used internally. All
 other values we can use ourselves to define different message types (sql
 queries, file grabs, etc...). In this example we will use @c type=1 for timer
-stuff.
+stuff. The second argument is the size of the data, for which room is allocated
+from a pool.
 
 @code
-				MOSH_FCGI::protocol::Message msg;
-				msg.type = 1;
-
-				{
-					char cString[] = "I was passed between two threads!!";
-					msg.size = sizeof(cString);
-					msg.data.reset(new char[sizeof(cString) + 1]);
-					std::strncpy(msg.data.get(), cString, sizeof(cString));
-				}
+				char cString[] = "I was passed between two threads!!";
+				MOSH_FCGI::protocol::Message msg(1, sizeof(cString));
+				std::strncpy(MOSH_FCGI::sign_cast<char*>(msg.data.get()), cString, sizeof(cString));
 @endcode
 
 Now we can give our callback function to our timer.
@@ -640,14 +661,9 @@ private:
 				out << "starting timer..." << s::br();
 				out.flush();
 				t.reset(new boost::asio::deadline_timer(io, boost::posix_time::seconds(5)));
-				protocol::Message msg;
-				msg.type = 1;
-				{
-					char cString[] = "I was passed between two threads!!";
-					msg.size = sizeof(cString);
-					msg.data.reset(new char[sizeof(cString) + 1]);
-					std::strncpy(msg.data.get(), cString, sizeof(cString));
-				}
+				char cString[] = "I was passed between two threads!!";
+				protocol::Message msg(1, sizeof(cString));
+				std::strncpy(sign_cast<char*>(msg.data.get()), cString, sizeof(cString));
 				t->async_wait(boost::bind(callback, msg));
 				state=FINISH;
 				return false;
@@ -0,0 +1,58 @@
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <chrono>
+#include <string>
+
+#include <mosh/fcgi/coro_request.hpp>
+#include <mosh/fcgi/http/header.hpp>
+#include <mosh/fcgi/manager.hpp>
+
+using namespace MOSH_FCGI;
+
+// The same as the timer example, without the state machine or a thread of our own:
+// the request reads the POST data as it comes in, waits a second, and answers.
+class Coro: public Coro_request {
+	Task run() {
+		out << http::header::content_type("text/plain", "US-ASCII");
+		out << "mosh-fcgi coroutine\r\n\r\n";
+
+		size_t total = 0;
+		for (;;) {
+			// Suspends until the next IN record comes in; an empty chunk means there are no more
+			u_string chunk = co_await next_chunk();
+			if (chunk.empty())
+				break;
+			total += chunk.size();
+		}
+		out << "got " << std::to_string(total) << " bytes of POST data\r\n";
+
+		// Make sure the client has seen that before waiting
+		co_await drain();
+
+		// Other requests are served meanwhile; this one only holds on to its coroutine frame
+		co_await sleep_for(std::chrono::seconds(1));
+		out << "a second later\r\n";
+	}
+};
+
+int main() {
+	ManagerT<Coro> fcgi;
+	fcgi.handler();
+}
@@ -195,7 +195,7 @@ class Echo: public Form_request<wchar_t> {
 			for (auto& e : envs) {
 				// Element instances are also appendable, so string data can be added
 				// inside an iteration or other unrollable control structure
-				ul += s::li(s::b(e.first)) + S(": ") + e.second;
+				ul += s::li(s::b(e.first)) + S(": ") + e.second.str();
 				ul += "\r\n";
 			}
 			out << s::p(ul);
@@ -22,6 +22,7 @@
 #include <fstream>
 #include <sstream>
 extern "C" {
+#include <fcntl.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -112,11 +113,14 @@ class Show_gnu: public MOSH_FCGI::Request_base {
 		}
 
 		/*
-		 * Do an unbuffered send of the image data by constructing an ifstream and then calling
-		 * Fcgistream::dump().
+		 * Send the image data straight from the file to the socket by opening it and then calling
+		 * Fcgistream::send_file(). Once it returns, the file can be closed.
 		 */
-		std::ifstream image("gnu.png");
-		out.dump(image);
+		int image = open("gnu.png", O_RDONLY);
+		if (image >= 0) {
+			out.send_file(image, 0, fileSize);
+			close(image);
+		}
 		
 		return true;
 	}
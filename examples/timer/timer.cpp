@@ -80,20 +80,14 @@ private:
 				// function again. The callback function is thread safe. That means you can pass messages back to
 				// requests from other threads.
 
-				// Let's build the message we want sent back to here.
-				protocol::Message msg;
+				// Let's build the message we want sent back to here. We'll put a character string into it. Just for fun.
+				char cString[] = "I was passed between two threads!!";
 				// The first part of the message we have to define is the type. A type of 0 means a fastcgi message
 				// and is used internally. All other values we can use ourselves to define different message types (sql queries,
-				// file grabs, etc...). We will use type=1 for timer stuff.
-				msg.type = 1;
-
-				// Now let's put a character string into the message as well. Just for fun.
-				{
-					char cString[] = "I was passed between two threads!!";
-					msg.size = sizeof(cString);
-					msg.data.reset(new uchar[sizeof(cString) + 1]);
-					std::strncpy(sign_cast<char*>(msg.data.get()), cString, sizeof cString);
-				}
+				// file grabs, etc...). We will use type=1 for timer stuff. The second is the size of the data, for which
+				// room is allocated from a pool.
+				protocol::Message msg(1, sizeof(cString));
+				std::strncpy(sign_cast<char*>(msg.data.get()), cString, sizeof cString);
 
 				// Now we will give our callback data to boost::asio
 				t->async_wait(([this, msg] (const boost::system::error_code&) { this->callback(msg); }));
@@ -24,6 +24,7 @@
 #define MOSH_FCGI_BLOCK_HPP
 
 #include <cstddef>
+#include <mutex>
 #include <mosh/fcgi/bits/types.hpp>
 #include <mosh/fcgi/bits/namespace.hpp>
 
@@ -33,6 +34,10 @@ MOSH_FCGI_BEGIN
 /*!
  * The purpose of this structure is to communicate a block of data to be written to
  * a Transceiver::Buffer
+ *
+ * A block handed out by Transceiver::request_write() holds the transceiver locked
+ * until it's passed to Transceiver::secure_write(), or destroyed, say by an exception
+ * thrown in between. It can be moved, not copied.
  */
 struct Block {
 	//! Construct from a pointer and size
@@ -41,24 +46,19 @@ struct Block {
 	 * @param[in] size Size in bytes of memory location
 	 */
 	Block(uchar* data, size_t size): data(data), size(size) { }
-	//! Copies pointer and size, not data
-	Block(const Block& block): data(block.data), size(block.size) { }
-	Block(Block& block) {
-		data = block.data;
-		size = block.size;
-	}
-	//! Copies pointer and size, not data
-	Block& operator=(const Block& block) {
-		if (this != &block) {
-			data = block.data;
-			size = block.size;
-		}
-		return *this;
-	}
+	//! Moves pointer, size and lock, not data
+	Block(Block&& block) = default;
+	//! Moves pointer, size and lock, not data
+	Block& operator=(Block&& block) = default;
 	//! Pointer to start of memory location
 	uchar* data;
 	//! Size in bytes of memory location
 	size_t size;
+	//! Lock on the transceiver the block belongs to, if any
+	std::unique_lock<std::recursive_mutex> lock;
+private:
+	Block(Block const&) = delete;
+	Block& operator=(Block const&) = delete;
 };
 
 MOSH_FCGI_END
@@ -0,0 +1,104 @@
+//! @file  mosh/fcgi/bits/cancel_token.hpp Request cancellation flag
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_CANCEL_TOKEN_HPP
+#define MOSH_FCGI_CANCEL_TOKEN_HPP
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Flag telling that work has been cancelled, which can be polled or subscribed to
+ *
+ * Polling it costs an atomic load, so it can be done as often as a long response
+ * likes, such as once per row of a report.
+ */
+class Cancel_token {
+public:
+	Cancel_token() : flag(false) { }
+
+	//! Test if the work has been cancelled; may be called from any thread
+	bool cancelled() const {
+		return flag.load(std::memory_order_acquire);
+	}
+
+	/*! @brief Have a function called once the work is cancelled
+	 *
+	 * The function is called from the thread that cancels, or right away if the work has
+	 * been cancelled already. It should do no more than pass on a message, such as by
+	 * calling Request_base::callback.
+	 *
+	 * @param[in] f Function to call
+	 */
+	void subscribe(std::function<void()> f) {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (!cancelled()) {
+				subscribers.push_back(std::move(f));
+				return;
+			}
+		}
+		f();
+	}
+
+	/*! @brief Cancel the work, calling the subscribed functions
+	 * @return false if it had been cancelled already
+	 */
+	bool cancel() {
+		std::vector<std::function<void()>> fs;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (flag.exchange(true, std::memory_order_acq_rel))
+				return false;
+			fs.swap(subscribers);
+		}
+		for (auto& f : fs)
+			f();
+		return true;
+	}
+
+	//! Make the token as good as new, dropping subscribers
+	void reset() {
+		std::lock_guard<std::mutex> l(lock);
+		flag.store(false, std::memory_order_relaxed);
+		subscribers.clear();
+	}
+
+private:
+	Cancel_token(Cancel_token const&) = delete;
+	Cancel_token& operator = (Cancel_token const&) = delete;
+
+	//! True once cancelled
+	std::atomic<bool> flag;
+	//! Guards subscribers, and the flag's change
+	std::mutex lock;
+	//! Functions to call once cancelled
+	std::vector<std::function<void()>> subscribers;
+};
+
+MOSH_FCGI_END
+
+#endif
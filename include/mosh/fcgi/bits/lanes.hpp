@@ -0,0 +1,138 @@
+//! @file  mosh/fcgi/bits/lanes.hpp Queue with priority lanes
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_LANES_HPP
+#define MOSH_FCGI_LANES_HPP
+
+#include <cstddef>
+#include <deque>
+#include <unordered_map>
+#include <utility>
+
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+//! Priority of an item in Lanes, highest first
+enum class Lane {
+	//! Management records, and requests aborted by the other side
+	urgent,
+	//! Requests all of whose input is in
+	ready,
+	//! Everything else, such as stdin of requests still uploading
+	bulk
+};
+
+/*! @brief Queue with priority lanes
+ *
+ * Items in a higher lane are taken before those in a lower one, except that the bulk
+ * lane is given one turn after every @c weight items taken from the ready lane, so it's
+ * never starved. Within the bulk lane, the connections items are for take turns, one
+ * item each, so a connection uploading a lot holds up the others no more than its share.
+ *
+ * Not synchronised.
+ *
+ * @tparam T Item type; must be movable
+ */
+template <typename T>
+class Lanes {
+public:
+	/*! @param[in] weight Items taken from the ready lane for every one from the bulk lane
+	 * 	while both have some
+	 */
+	explicit Lanes(size_t weight = 8) : weight(weight ? weight : 1), streak(0), count(0) { }
+
+	/*! @brief Append an item
+	 * @param[in] item The item
+	 * @param[in] lane Lane to put it in
+	 * @param[in] fd Connection it's for, by which the bulk lane takes turns
+	 */
+	void push(T item, Lane lane, int fd) {
+		switch (lane) {
+		case Lane::urgent:
+			urgent.push_back(std::move(item));
+			break;
+		case Lane::ready:
+			ready.push_back(std::move(item));
+			break;
+		default: {
+			std::deque<T>& q = bulk[fd];
+			if (q.empty())
+				turns.push_back(fd);
+			q.push_back(std::move(item));
+		}
+		}
+		++count;
+	}
+
+	/*! @brief Take the next item
+	 * @param[out] item The item taken
+	 * @return false if there are none
+	 */
+	bool pop(T& item) {
+		if (!urgent.empty()) {
+			item = std::move(urgent.front());
+			urgent.pop_front();
+		} else if (!ready.empty() && (turns.empty() || streak < weight)) {
+			item = std::move(ready.front());
+			ready.pop_front();
+			++streak;
+		} else if (!turns.empty()) {
+			int fd = turns.front();
+			turns.pop_front();
+			auto it = bulk.find(fd);
+			item = std::move(it->second.front());
+			it->second.pop_front();
+			if (it->second.empty())
+				bulk.erase(it);
+			else
+				turns.push_back(fd);
+			streak = 0;
+		} else
+			return false;
+		--count;
+		return true;
+	}
+
+	//! Test if there are no items
+	bool empty() const { return !count; }
+	//! Number of items
+	size_t size() const { return count; }
+
+private:
+	//! Items in the urgent lane
+	std::deque<T> urgent;
+	//! Items in the ready lane
+	std::deque<T> ready;
+	//! Items in the bulk lane, by connection
+	std::unordered_map<int, std::deque<T>> bulk;
+	//! Connections with items in the bulk lane, in the order they take their turns
+	std::deque<int> turns;
+	//! Items taken from the ready lane for every one from the bulk lane
+	size_t weight;
+	//! Items taken from the ready lane since the bulk lane last had a turn
+	size_t streak;
+	//! Number of items
+	size_t count;
+};
+
+MOSH_FCGI_END
+
+#endif
@@ -0,0 +1,156 @@
+//! @file  mosh/fcgi/bits/mpsc_queue.hpp Multiple-producer, single-consumer queue
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_MPSC_QUEUE_HPP
+#define MOSH_FCGI_MPSC_QUEUE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Queue with any number of threads pushing and a single one popping
+ *
+ * Items go into a lock-free ring of N slots, in which each slot carries a sequence
+ * number telling whether it's free or filled in. Should the ring be full, items spill
+ * over into a list guarded by a mutex, and keep going there until the consumer has
+ * emptied it, so push() never blocks on the consumer. The items pushed by any one
+ * thread come out in the order they went in.
+ *
+ * @tparam T Item type; must be default-constructible and movable
+ * @tparam N Number of slots in the ring; must be a power of 2
+ */
+template <typename T, size_t N>
+class Mpsc_queue {
+	static_assert(N && !(N & (N - 1)), "Mpsc_queue: N must be a power of 2");
+public:
+	Mpsc_queue() : tail(0), head(0), spilled(false) {
+		for (size_t i = 0; i < N; ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	//! Append an item; may be called from any thread
+	void push(T item) {
+		if (!spilled.load(std::memory_order_acquire) && try_push(item))
+			return;
+		std::lock_guard<std::mutex> lock(overflow_lock);
+		overflow.push_back(std::move(item));
+		spilled.store(true, std::memory_order_release);
+	}
+
+	/*! @brief Take the item at the front; may only be called by the consumer
+	 * @param[out] item The item taken
+	 * @return false if the queue is empty
+	 */
+	bool pop(T& item) {
+		Cell& cell = cells[head & (N - 1)];
+		for (;;) {
+			if (cell.seq.load(std::memory_order_acquire) == head + 1) {
+				item = std::move(cell.value);
+				// Don't hold on to what the item refers to until the slot is reused
+				cell.value = T();
+				cell.seq.store(head + N, std::memory_order_release);
+				++head;
+				return true;
+			}
+			if (tail.load(std::memory_order_acquire) == head)
+				break;
+			// A producer has claimed the slot but not filled it in yet
+			std::this_thread::yield();
+		}
+		if (!spilled.load(std::memory_order_acquire))
+			return false;
+		std::lock_guard<std::mutex> lock(overflow_lock);
+		if (overflow.empty())
+			return false;
+		item = std::move(overflow.front());
+		overflow.pop_front();
+		if (overflow.empty())
+			spilled.store(false, std::memory_order_release);
+		return true;
+	}
+
+	//! Test if the queue is empty; may only be called by the consumer
+	bool empty() const {
+		return tail.load(std::memory_order_acquire) == head && !spilled.load(std::memory_order_acquire);
+	}
+
+private:
+	Mpsc_queue(Mpsc_queue const&) = delete;
+	Mpsc_queue& operator = (Mpsc_queue const&) = delete;
+
+	//! Slot of the ring
+	struct Cell {
+		/*! @brief Sequence number
+		 *
+		 * Equal to the position a producer may claim the slot at while free, one past
+		 * it once filled in, and the position of the next lap once taken again.
+		 */
+		std::atomic<size_t> seq;
+		//! The item
+		T value;
+	};
+
+	//! Move an item into the ring, unless it's full
+	bool try_push(T& item) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & (N - 1)];
+			size_t seq = cell.seq.load(std::memory_order_acquire);
+			if (seq == pos) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = std::move(item);
+					cell.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (static_cast<ptrdiff_t>(seq - pos) < 0)
+				// The slot still holds the item from the previous lap
+				return false;
+			else
+				pos = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	//! The ring
+	std::array<Cell, N> cells;
+	//! Position the next producer claims
+	std::atomic<size_t> tail;
+	//! Keeps tail and head off each other's cache line. Not alignas, which plain @c new doesn't honour before C++17.
+	char padding[64 - sizeof(std::atomic<size_t>)];
+	//! Position of the next item to take; touched by the consumer only
+	size_t head;
+	//! True while items are going into overflow
+	std::atomic<bool> spilled;
+	//! Items that didn't fit in the ring
+	std::deque<T> overflow;
+	//! Guards overflow
+	std::mutex overflow_lock;
+};
+
+MOSH_FCGI_END
+
+#endif
@@ -0,0 +1,129 @@
+//! @file  mosh/fcgi/bits/poller.hpp Readiness notification backends
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_POLLER_HPP
+#define MOSH_FCGI_POLLER_HPP
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+extern "C" {
+#include <poll.h>
+}
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief File descriptor readiness notification
+ *
+ * This class abstracts the mechanism used by Transceiver to wait on its
+ * sockets. Interest and readiness are both expressed in terms of the
+ * @c poll() event bits (@c POLLIN, @c POLLOUT, @c POLLHUP, @c POLLERR),
+ * regardless of the backend in use.
+ *
+ * A descriptor may be registered as edge-triggered. Backends which cannot
+ * provide edge-triggered notification fall back to level-triggered, so the
+ * caller must always consume a descriptor until @c EAGAIN when it asks for
+ * edge-triggered notification.
+ */
+class Poller {
+public:
+	//! Available backends
+	enum class Backend {
+		//! Best backend available on this system
+		automatic = 0,
+		//! @c poll(); available everywhere
+		poll,
+		//! @c epoll(7); Linux only
+		epoll,
+		/*! @brief @c io_uring(7) poll requests; Linux 5.9 or later
+		 *
+		 * Only available if the library is built with @c MOSH_FCGI_USE_IO_URING defined.
+		 * Changes in interest cost no system call of their own; they are submitted along
+		 * with the next wait(). Notification is always level-triggered.
+		 */
+		io_uring,
+	};
+
+	//! A readiness event
+	struct Event {
+		Event(int fd, short events) : fd(fd), events(events) { }
+		//! File descriptor that is ready
+		int fd;
+		//! Ready events (@c POLLIN, @c POLLOUT, @c POLLHUP, @c POLLERR)
+		short events;
+	};
+
+	/*! @brief Create a poller
+	 *
+	 * If the requested backend is unavailable, the next best one is used instead, down
+	 * to @c poll(). Backend::automatic never picks Backend::io_uring; it has to be asked
+	 * for.
+	 *
+	 * @param[in] backend Requested backend
+	 * @throws exceptions::Poll if the backend could not be initialized
+	 */
+	static std::unique_ptr<Poller> create(Backend backend = Backend::automatic);
+
+	virtual ~Poller() { }
+
+	/*! @brief Register a file descriptor
+	 * @param[in] fd File descriptor to watch
+	 * @param[in] events Events of interest
+	 * @param[in] edge Request edge-triggered notification
+	 */
+	virtual void add(int fd, short events, bool edge = false) = 0;
+	/*! @brief Change the events of interest for a registered file descriptor
+	 * @param[in] fd File descriptor to modify
+	 * @param[in] events Events of interest
+	 * @param[in] edge Request edge-triggered notification
+	 */
+	virtual void modify(int fd, short events, bool edge = false) = 0;
+	/*! @brief Unregister a file descriptor
+	 *
+	 * Unregistering a file descriptor that isn't registered is a no-op.
+	 *
+	 * @param[in] fd File descriptor to forget
+	 */
+	virtual void remove(int fd) = 0;
+	/*! @brief Wait for readiness
+	 *
+	 * Every ready file descriptor is appended to @c ready, not just the first one.
+	 *
+	 * @param[out] ready Container to append ready events to
+	 * @param[in] timeout Timeout in milliseconds; -1 blocks indefinitely
+	 * @return Number of events appended. Interruption by a signal yields 0.
+	 * @throws exceptions::Poll on failure
+	 */
+	virtual size_t wait(std::vector<Event>& ready, int timeout) = 0;
+	//! Get the backend actually in use
+	virtual Backend backend() const = 0;
+
+protected:
+	Poller() { }
+
+private:
+	Poller(Poller const&) = delete;
+	Poller& operator = (Poller const&) = delete;
+};
+
+MOSH_FCGI_END
+
+#endif
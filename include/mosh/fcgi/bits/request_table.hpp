@@ -0,0 +1,133 @@
+//! @file  mosh/fcgi/bits/request_table.hpp Table of active requests
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_REQUEST_TABLE_HPP
+#define MOSH_FCGI_REQUEST_TABLE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <mosh/fcgi/protocol/full_id.hpp>
+#include <mosh/fcgi/protocol/types.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+class Request_base;
+
+/*! @brief Active requests, indexed directly by file descriptor and request id
+ *
+ * Each connection has a flat array of slots indexed by request id, found through a
+ * table indexed by file descriptor. Lookups take no lock:
+ *  - the fd table is replaced by a larger copy when it has to grow, and the old one is
+ *    kept around until the table is destroyed, so a reader may go on using whichever
+ *    one it loaded;
+ *  - the slots of a connection are allocated the first time its file descriptor is
+ *    seen, and kept for whichever connection gets that descriptor next;
+ *  - slots are read and written with the atomic operations of @c std::shared_ptr, so a
+ *    request taken out of the table lives on until the last reader is done with it.
+ *
+ * Changes are serialised with a mutex. Request ids of @c slots and up, which the other
+ * side rarely uses, are kept in a map guarded by that mutex.
+ */
+class Request_table {
+public:
+	//! Number of request ids with a slot of their own
+	static const size_t slots = 32;
+
+	Request_table();
+	~Request_table();
+
+	/*! @brief Find a request; may be called from any thread
+	 * @param[in] id Full_id of the request
+	 * @return The request, or null if there is none
+	 */
+	std::shared_ptr<Request_base> find(protocol::Full_id id) const;
+	/*! @brief Put a request in, replacing any there is under the same id
+	 * @param[in] id Full_id of the request
+	 * @param[in] request The request
+	 */
+	void insert(protocol::Full_id id, std::shared_ptr<Request_base> const& request);
+	/*! @brief Take a request out, unless it's been replaced meanwhile
+	 * @param[in] id Full_id of the request
+	 * @param[in] request The request expected under id
+	 */
+	void erase(protocol::Full_id id, std::shared_ptr<Request_base> const& request);
+	/*! @brief Test if any request on a connection satisfies pred
+	 * @param[in] fd File descriptor of the connection
+	 * @param[in] pred Predicate
+	 */
+	bool any_of(int fd, std::function<bool(Request_base const&)> const& pred) const;
+
+	//! Number of requests
+	size_t size() const { return count.load(std::memory_order_acquire); }
+	//! Test if there are no requests
+	bool empty() const { return size() == 0; }
+
+private:
+	Request_table(Request_table const&) = delete;
+	Request_table& operator = (Request_table const&) = delete;
+
+	//! Requests of one file descriptor
+	struct Connection {
+		Connection() : count(0) { }
+		//! Requests with an id under slots
+		std::array<std::shared_ptr<Request_base>, slots> requests;
+		//! Requests with larger ids; guarded by lock
+		std::map<protocol::Request_id, std::shared_ptr<Request_base>> overflow;
+		//! Number of requests
+		std::atomic<size_t> count;
+	};
+
+	//! Connections indexed by file descriptor
+	struct Fds {
+		explicit Fds(size_t size);
+		//! Number of entries
+		size_t size;
+		//! The entries; null until a request is put in
+		std::unique_ptr<std::atomic<Connection*>[]> entries;
+	};
+
+	//! Find the connection of a file descriptor, if it has one yet
+	Connection* connection(int fd) const;
+	//! Find or make the connection of a file descriptor; lock must be held
+	Connection& make_connection(int fd);
+
+	//! Current fd table
+	std::atomic<Fds*> fds;
+	//! Fd tables that have been replaced, along with the current one
+	std::vector<std::unique_ptr<Fds>> tables;
+	//! Every connection there is
+	std::vector<std::unique_ptr<Connection>> connections;
+	//! Number of requests
+	std::atomic<size_t> count;
+	//! Serialises changes, and guards Connection::overflow
+	mutable std::mutex lock;
+};
+
+MOSH_FCGI_END
+
+#endif
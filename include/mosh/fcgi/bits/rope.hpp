@@ -0,0 +1,142 @@
+//! @file  mosh/fcgi/bits/rope.hpp Byte string made of shared slices
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_ROPE_HPP
+#define MOSH_FCGI_ROPE_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include <mosh/fcgi/bits/u.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Byte string made of slices of buffers owned elsewhere
+ *
+ * Appending a slice of a reference counted buffer, such as the record a
+ * protocol::Message carries, takes a reference to the buffer instead of copying
+ * the bytes, so a body of any size is put together without copying. The slices
+ * can be gone through as they are, like an iovec, or the bytes one by one through
+ * begin() and end(). data() joins the slices into one buffer, once, for the odd
+ * consumer that needs the whole lot contiguous.
+ */
+class Rope {
+public:
+	//! Run of bytes in a buffer
+	struct Slice {
+		//! First byte; shares ownership of the buffer
+		std::shared_ptr<const uchar> data;
+		//! Number of bytes
+		size_t size;
+	};
+	typedef uchar value_type;
+	typedef size_t size_type;
+
+	//! Iterator over the bytes
+	class const_iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef uchar value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const uchar* pointer;
+		typedef const uchar& reference;
+
+		const_iterator() : slice(nullptr), offset(0) { }
+		const uchar& operator * () const { return slice->data.get()[offset]; }
+		const uchar* operator -> () const { return slice->data.get() + offset; }
+		const_iterator& operator ++ () {
+			if (++offset == slice->size) {
+				++slice;
+				offset = 0;
+			}
+			return *this;
+		}
+		const_iterator operator ++ (int) {
+			const_iterator it(*this);
+			++*this;
+			return it;
+		}
+		bool operator == (const_iterator const& it) const { return slice == it.slice && offset == it.offset; }
+		bool operator != (const_iterator const& it) const { return !(*this == it); }
+	private:
+		friend class Rope;
+		const_iterator(const Slice* slice, size_t offset) : slice(slice), offset(offset) { }
+		//! Slice of the byte
+		const Slice* slice;
+		//! Position of the byte in it
+		size_t offset;
+	};
+	typedef const_iterator iterator;
+
+	Rope() : total(0) { }
+
+	/*! @brief Append a slice, sharing the buffer
+	 * @param[in] data First byte. Build it with the aliasing constructor of
+	 * 	@c std::shared_ptr to point into a buffer owned by another one.
+	 * @param[in] size Number of bytes
+	 */
+	void append(std::shared_ptr<const uchar> data, size_t size);
+	/*! @brief Append bytes by copying them
+	 * @param[in] data First byte
+	 * @param[in] size Number of bytes
+	 */
+	void append(const uchar* data, size_t size);
+
+	//! Number of bytes
+	size_t size() const { return total; }
+	bool empty() const { return !total; }
+	//! Drop the slices, letting go of their buffers
+	void clear();
+
+	//! The slices, in order; none is empty
+	std::vector<Slice> const& slices() const { return parts; }
+	const_iterator begin() const { return const_iterator(parts.data(), 0); }
+	const_iterator end() const { return const_iterator(parts.data() + parts.size(), 0); }
+
+	/*! @brief The bytes, contiguous
+	 *
+	 * With more than one slice, they are first joined into a single buffer, which is
+	 * the only time the bytes are copied.
+	 *
+	 * @return The first byte; null if empty
+	 */
+	const uchar* data();
+
+	/*! @brief Copy bytes out
+	 * @param[out] dest Where to copy to
+	 * @param[in] count Most bytes to copy
+	 * @param[in] pos Position of the first byte to copy
+	 * @return Number of bytes copied
+	 */
+	size_t copy(uchar* dest, size_t count, size_t pos = 0) const;
+
+private:
+	//! The slices
+	std::vector<Slice> parts;
+	//! Number of bytes
+	size_t total;
+};
+
+MOSH_FCGI_END
+
+#endif
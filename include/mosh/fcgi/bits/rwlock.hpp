@@ -91,6 +91,10 @@ public:
 	void unlock() noexcept;
 
 	/*! @brief Upgrade a read lock to a write lock
+	 *
+	 * The read lock is released before the write lock is taken, so whatever was read
+	 * under it may have changed by the time this returns.
+	 *
 	 * @sa unlock
 	 * @sa write_lock
 	 */
@@ -103,8 +107,6 @@ public:
 private:
 	//! Reader-writer lock
 	pthread_rwlock_t lck;
-	//! Upgrade lock
-	std::mutex up_lock;
 };
 
 MOSH_FCGI_END
@@ -0,0 +1,141 @@
+//! @file  mosh/fcgi/bits/slab_pool.hpp Size-class pool for message buffers
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_SLAB_POOL_HPP
+#define MOSH_FCGI_SLAB_POOL_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <mosh/fcgi/bits/types.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Thread-safe pool of buffers in a few size classes
+ *
+ * Buffers are handed out as @c std::shared_ptr<uchar> whose control block lives in
+ * the same allocation as the data, so a buffer costs one allocation, and none at all
+ * once the pool is warm. Freed blocks are kept on a free list per size class, up to
+ * a limit, for the next allocation of that class. A buffer larger than the largest
+ * class is allocated the usual way.
+ *
+ * Buffers may be released from any thread.
+ */
+class Slab_pool {
+public:
+	//! Usage counters of a size class
+	struct Stats {
+		//! Data size of buffers in the class; 0 for buffers too large for any class
+		size_t size;
+		//! Allocations served from the free list
+		size_t hits;
+		//! Allocations that had to go to the heap
+		size_t misses;
+		//! Blocks currently on the free list
+		size_t cached;
+	};
+
+	//! Number of size classes
+	static const size_t classes = 5;
+	//! Data sizes of the classes. The last one fits the largest possible record.
+	static const std::array<size_t, classes> sizes;
+
+	//! The pool shared by the whole process
+	static Slab_pool& instance();
+
+	/*! @brief Allocate a buffer
+	 * @param[in] size Minimum size of the buffer
+	 * @param[out] capacity Actual size of the buffer, which is that of its class
+	 * @return The buffer
+	 */
+	std::shared_ptr<uchar> allocate(size_t size, size_t& capacity);
+	/*! @brief Allocate a buffer
+	 * @param[in] size Minimum size of the buffer
+	 * @return The buffer
+	 */
+	std::shared_ptr<uchar> allocate(size_t size) {
+		size_t capacity;
+		return allocate(size, capacity);
+	}
+
+	//! Get the counters of every class, followed by those of oversized buffers
+	std::vector<Stats> stats() const;
+
+	//! Allocator drawing from a Slab_pool; used with @c std::allocate_shared
+	template <typename T>
+	struct Allocator {
+		typedef T value_type;
+		explicit Allocator(Slab_pool& pool) : pool(&pool) { }
+		template <typename U>
+		Allocator(Allocator<U> const& other) : pool(other.pool) { }
+		T* allocate(size_t n) {
+			return static_cast<T*>(pool->get(n * sizeof(T)));
+		}
+		void deallocate(T* p, size_t n) {
+			pool->put(p, n * sizeof(T));
+		}
+		Slab_pool* pool;
+	};
+
+	//! Take a block of at least bytes bytes
+	void* get(size_t bytes);
+	//! Give back a block obtained from get()
+	void put(void* p, size_t bytes);
+
+private:
+	Slab_pool();
+	Slab_pool(Slab_pool const&) = delete;
+	Slab_pool& operator = (Slab_pool const&) = delete;
+
+	//! Find the class of a block size; classes if it's too large for any
+	static size_t class_of(size_t bytes);
+
+	//! A size class
+	struct Class {
+		Class() : hits(0), misses(0) { }
+		//! Blocks ready for reuse
+		std::vector<void*> free;
+		//! Guards free
+		mutable std::mutex lock;
+		std::atomic<size_t> hits;
+		std::atomic<size_t> misses;
+	};
+	//! The size classes, plus one counting oversized buffers
+	std::array<Class, classes + 1> slabs;
+};
+
+template <typename T, typename U>
+bool operator == (Slab_pool::Allocator<T> const& a, Slab_pool::Allocator<U> const& b) {
+	return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator != (Slab_pool::Allocator<T> const& a, Slab_pool::Allocator<U> const& b) {
+	return a.pool != b.pool;
+}
+
+MOSH_FCGI_END
+
+#endif
@@ -0,0 +1,157 @@
+//! @file  mosh/fcgi/bits/spill_buffer.hpp Body buffer that moves to a file past a threshold
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_SPILL_BUFFER_HPP
+#define MOSH_FCGI_SPILL_BUFFER_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <mosh/fcgi/bits/rope.hpp>
+#include <mosh/fcgi/bits/u.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Byte string kept in memory up to a threshold, and in a file past it
+ *
+ * A small body is kept in a Rope, sharing the records it came in. Once it grows
+ * past the threshold it is written out to an anonymous file, a memfd or an unlinked
+ * temporary file, and everything appended afterwards goes straight there, so what a
+ * request holds in memory stays bounded whatever the size of the upload. The file is
+ * read back through a read-only mapping, which the kernel pages in and out as needed.
+ *
+ * Use it as the Post_buf or Data_buf of a Request:
+ * @code
+ * Spill_buffer::defaults().threshold = 256 << 10;
+ * Spill_buffer::defaults().directory = "/var/tmp";
+ * class My_request : public Request<Spill_buffer, Spill_buffer> { ... };
+ * @endcode
+ */
+class Spill_buffer {
+public:
+	//! Tunables for a Spill_buffer
+	struct Options {
+		Options() : threshold(1 << 20) { }
+		//! Bytes kept in memory; any more and the buffer moves to a file
+		size_t threshold;
+		/*! @brief Directory of the file; empty for a memfd
+		 *
+		 * A memfd lives in memory that can be swapped out, like tmpfs; to keep large
+		 * bodies on disk, name a directory there. Without memfd support, an empty
+		 * directory means @c $TMPDIR, or @c /tmp.
+		 */
+		std::string directory;
+	};
+	typedef uchar value_type;
+	typedef size_t size_type;
+	typedef const uchar* const_iterator;
+	typedef const_iterator iterator;
+
+	/*! @brief Options used by default construction
+	 *
+	 * Set these before any request is created; they are not guarded by a lock.
+	 */
+	static Options& defaults();
+
+	Spill_buffer() : Spill_buffer(defaults()) { }
+	//! @param[in] options Tunables
+	explicit Spill_buffer(Options const& options);
+	Spill_buffer(Spill_buffer&& b);
+	Spill_buffer& operator = (Spill_buffer&& b);
+	~Spill_buffer();
+
+	/*! @brief Append a slice, sharing the buffer while the bytes stay in memory
+	 * @param[in] data First byte
+	 * @param[in] size Number of bytes
+	 * @throws std::system_error if the file can't be created or written
+	 */
+	void append(std::shared_ptr<const uchar> data, size_t size);
+	/*! @brief Append bytes by copying them
+	 * @param[in] data First byte
+	 * @param[in] size Number of bytes
+	 * @throws std::system_error if the file can't be created or written
+	 */
+	void append(const uchar* data, size_t size);
+
+	//! Number of bytes
+	size_t size() const { return total; }
+	bool empty() const { return !total; }
+	//! Whether the bytes have moved to a file
+	bool spilled() const { return fd >= 0; }
+	/*! @brief File descriptor of the file
+	 * @return The descriptor, owned by the buffer; -1 if not spilled()
+	 */
+	int file() const { return fd; }
+	//! Drop the bytes, closing the file if there is one
+	void clear();
+
+	/*! @brief The bytes, contiguous
+	 *
+	 * In memory, the slices are joined as with Rope::data(). In a file, the file is
+	 * mapped, and mapped again only if it has grown since.
+	 *
+	 * @return The first byte; null if empty
+	 * @throws std::system_error if the file can't be mapped
+	 */
+	const uchar* data();
+	const_iterator begin() { return data(); }
+	const_iterator end() { return data() + total; }
+
+	/*! @brief Copy bytes out, without mapping the file
+	 * @param[out] dest Where to copy to
+	 * @param[in] count Most bytes to copy
+	 * @param[in] pos Position of the first byte to copy
+	 * @return Number of bytes copied
+	 * @throws std::system_error if the file can't be read
+	 */
+	size_t copy(uchar* dest, size_t count, size_t pos = 0) const;
+
+private:
+	Spill_buffer(Spill_buffer const&) = delete;
+	Spill_buffer& operator = (Spill_buffer const&) = delete;
+
+	//! Create the file and move the bytes held in memory to it
+	void spill();
+	//! Write bytes at the end of the file
+	void write(const uchar* data, size_t size);
+	//! Unmap the file
+	void unmap();
+
+	//! Bytes kept in memory
+	size_t threshold;
+	//! Directory of the file
+	std::string directory;
+	//! The bytes, until spilled
+	Rope memory;
+	//! The file; -1 until spilled
+	int fd;
+	//! Mapping of the file
+	void* map;
+	//! Size of the mapping
+	size_t mapped;
+	//! Number of bytes
+	size_t total;
+};
+
+MOSH_FCGI_END
+
+#endif
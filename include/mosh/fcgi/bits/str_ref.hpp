@@ -0,0 +1,83 @@
+//! @file  mosh/fcgi/bits/str_ref.hpp Reference to a run of characters
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_STR_REF_HPP
+#define MOSH_FCGI_STR_REF_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Reference to a run of characters stored elsewhere
+ *
+ * What std::string_view is to C++17, for a library built as C++11. The characters
+ * aren't null-terminated; use str() for a std::string, to which it also converts.
+ */
+class Str_ref {
+public:
+	typedef const char* const_iterator;
+
+	Str_ref() : p(""), n(0) { }
+	Str_ref(const char* s) : p(s), n(std::strlen(s)) { }
+	Str_ref(const char* s, size_t size) : p(s), n(size) { }
+	Str_ref(std::string const& s) : p(s.data()), n(s.size()) { }
+
+	const char* data() const { return p; }
+	size_t size() const { return n; }
+	bool empty() const { return !n; }
+	const_iterator begin() const { return p; }
+	const_iterator end() const { return p + n; }
+	char operator [] (size_t i) const { return p[i]; }
+
+	//! Copy the characters into a std::string
+	std::string str() const { return std::string(p, n); }
+	operator std::string() const { return str(); }
+
+	friend bool operator == (Str_ref a, Str_ref b) {
+		return a.n == b.n && !std::memcmp(a.p, b.p, a.n);
+	}
+	friend bool operator != (Str_ref a, Str_ref b) {
+		return !(a == b);
+	}
+	friend bool operator < (Str_ref a, Str_ref b) {
+		int c = std::memcmp(a.p, b.p, std::min(a.n, b.n));
+		return c ? c < 0 : a.n < b.n;
+	}
+
+private:
+	//! First character
+	const char* p;
+	//! Number of characters
+	size_t n;
+};
+
+template <typename Traits>
+std::basic_ostream<char, Traits>& operator << (std::basic_ostream<char, Traits>& os, Str_ref s) {
+	return os.write(s.data(), s.size());
+}
+
+MOSH_FCGI_END
+
+#endif
@@ -0,0 +1,373 @@
+//! @file  mosh/fcgi/coro_request.hpp Defines the Coro_request class
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_CORO_REQUEST_HPP
+#define MOSH_FCGI_CORO_REQUEST_HPP
+
+// The library itself is C++11; only code including this header needs C++20
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "mosh/fcgi/coro_request.hpp needs C++20 coroutines"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <mosh/fcgi/request.hpp>
+#include <mosh/fcgi/protocol/message.hpp>
+#include <mosh/fcgi/bits/u.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Thread calling functions at given times
+ *
+ * One thread serves every Coro_request in the process, so a sleeping request costs
+ * an entry in a map rather than a thread.
+ */
+class Coro_timer {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	//! The timer shared by the whole process
+	static Coro_timer& instance() {
+		// Never destroyed, as its thread is never joined
+		static Coro_timer* timer = new Coro_timer;
+		return *timer;
+	}
+
+	/*! @brief Call a function at a given time, from the timer's thread
+	 * @param[in] when Time to call f at
+	 * @param[in] f Function to call; it should do no more than pass on a message
+	 */
+	void at(Clock::time_point when, std::function<void()> f) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			bool earliest = due.empty() || when < due.begin()->first;
+			due.emplace(when, std::move(f));
+			if (!earliest)
+				return;
+		}
+		wakeup.notify_one();
+	}
+
+private:
+	Coro_timer() {
+		std::thread(&Coro_timer::run, this).detach();
+	}
+	Coro_timer(Coro_timer const&) = delete;
+	Coro_timer& operator = (Coro_timer const&) = delete;
+
+	//! Body of the timer's thread
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			if (due.empty()) {
+				wakeup.wait(lock);
+				continue;
+			}
+			auto next = due.begin();
+			if (Clock::now() < next->first) {
+				wakeup.wait_until(lock, next->first);
+				continue;
+			}
+			std::function<void()> f(std::move(next->second));
+			due.erase(next);
+			lock.unlock();
+			f();
+			lock.lock();
+		}
+	}
+
+	//! Functions to call, by time
+	std::multimap<Clock::time_point, std::function<void()>> due;
+	//! Guards due
+	std::mutex mutex;
+	//! Signalled when an entry earlier than any other is added
+	std::condition_variable wakeup;
+};
+
+/*! @brief %Request handling as a coroutine
+ *
+ * Instead of reacting to each record through handlers, a derivation defines run() as
+ * a coroutine that goes through the request from start to finish, suspending whenever
+ * it has to wait:
+ *  - <tt>co_await next_chunk()</tt> for the next chunk of stdin (IN records);
+ *  - <tt>co_await sleep_for(d)</tt> for a while;
+ *  - <tt>co_await next_message()</tt> for a message passed to the request through
+ *    @c callback from elsewhere, such as the completion of some I/O on another thread;
+ *  - <tt>co_await drain()</tt> for the output written so far to have gone out.
+ *
+ * The request is complete once run() returns. An exception thrown out of it ends the
+ * request the same way one thrown out of response() does.
+ *
+ * The coroutine is resumed from Manager::handler(), or a worker of the Manager, like any
+ * other handling of the request: whatever it waits on sends the request a message, which
+ * the Manager queues and hands over in turn. No thread is tied up while it's suspended, so
+ * a request in flight costs little more than its coroutine frame.
+ *
+ * The coroutine starts once the parameters are in, with envs filled in. FCGI_DATA
+ * records are passed to data_handler() as usual.
+ *
+ * @note A Manager must outlive the sleeps of its requests.
+ */
+class Coro_request : public virtual Request_base {
+public:
+	//! Return type of run()
+	class Task {
+	public:
+		//! Promise of the coroutine
+		struct promise_type {
+			Task get_return_object() {
+				return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			//! run() starts when first resumed
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			//! The frame is kept until the Task is destroyed
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() noexcept { }
+			void unhandled_exception() noexcept { error = std::current_exception(); }
+			//! Exception thrown out of the coroutine
+			std::exception_ptr error;
+		};
+
+		Task() noexcept { }
+		Task(Task&& t) noexcept : handle(std::exchange(t.handle, nullptr)) { }
+		Task& operator = (Task&& t) noexcept {
+			if (this != &t) {
+				destroy();
+				handle = std::exchange(t.handle, nullptr);
+			}
+			return *this;
+		}
+		~Task() { destroy(); }
+
+		//! Test if there is a coroutine
+		explicit operator bool() const noexcept { return bool(handle); }
+		//! Test if the coroutine has returned
+		bool done() const noexcept { return handle && handle.done(); }
+
+	private:
+		friend class Coro_request;
+		explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle(h) { }
+		Task(Task const&) = delete;
+		Task& operator = (Task const&) = delete;
+
+		//! Resume the coroutine, rethrowing whatever it threw once it's done
+		void resume() {
+			handle.resume();
+			if (handle.done() && handle.promise().error)
+				std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+		}
+		void destroy() noexcept {
+			if (handle)
+				handle.destroy();
+			handle = nullptr;
+		}
+
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	//! Type of the messages a Coro_request sends itself to be resumed; not for other use
+	static const unsigned resume_type = ~0u;
+
+	Coro_request() : waiting(Wait::none), stdin_done(false), finishing(false), token(0) { }
+	virtual ~Coro_request() { }
+
+protected:
+	//! The coroutine going through the request
+	virtual Task run() = 0;
+
+	//! Awaitable for the next chunk of stdin
+	struct Chunk_awaiter {
+		Coro_request& r;
+		bool await_ready() const noexcept { return !r.chunks.empty() || r.stdin_done; }
+		void await_suspend(std::coroutine_handle<>) noexcept { r.waiting = Wait::chunk; }
+		//! The chunk; empty once stdin is over
+		u_string await_resume() {
+			if (r.chunks.empty())
+				return u_string();
+			u_string chunk(std::move(r.chunks.front()));
+			r.chunks.pop_front();
+			return chunk;
+		}
+	};
+	//! Awaitable for a message passed through callback
+	struct Message_awaiter {
+		Coro_request& r;
+		bool await_ready() const noexcept { return !r.inbox.empty(); }
+		void await_suspend(std::coroutine_handle<>) noexcept { r.waiting = Wait::message; }
+		protocol::Message await_resume() {
+			protocol::Message m(std::move(r.inbox.front()));
+			r.inbox.pop_front();
+			return m;
+		}
+	};
+	//! Awaitable for a while to pass
+	struct Sleep_awaiter {
+		Coro_request& r;
+		Coro_timer::Clock::duration duration;
+		bool await_ready() const noexcept { return duration <= Coro_timer::Clock::duration::zero(); }
+		void await_suspend(std::coroutine_handle<>) {
+			Coro_timer::instance().at(Coro_timer::Clock::now() + duration, r.resumer());
+			r.waiting = Wait::resume;
+		}
+		void await_resume() noexcept { }
+	};
+	//! Awaitable for the output to go out
+	struct Drain_awaiter {
+		Coro_request& r;
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<>) {
+			if (r.out.when_drained(r.resumer()))
+				return false;
+			r.waiting = Wait::resume;
+			return true;
+		}
+		void await_resume() noexcept { }
+	};
+
+	/*! @brief Wait for the next chunk of stdin
+	 * @return Awaitable yielding the chunk, which is empty once stdin is over
+	 */
+	Chunk_awaiter next_chunk() { return Chunk_awaiter{*this}; }
+	/*! @brief Wait for a message passed through callback
+	 * @return Awaitable yielding the message. It's type is neither 0 nor resume_type.
+	 */
+	Message_awaiter next_message() { return Message_awaiter{*this}; }
+	/*! @brief Wait for a while
+	 * @param[in] duration How long to wait
+	 */
+	Sleep_awaiter sleep_for(Coro_timer::Clock::duration duration) { return Sleep_awaiter{*this, duration}; }
+	/*! @brief Flush out, and wait for the output to go out
+	 *
+	 * Waits until the connection's buffered output is down to Transceiver::Options::low_water,
+	 * or all gone with backpressure off.
+	 */
+	Drain_awaiter drain() { return Drain_awaiter{*this}; }
+
+	//! Drop the coroutine and whatever it was waiting on
+	virtual void reset() {
+		Request_base::reset();
+		task = Task();
+		waiting = Wait::none;
+		chunks.clear();
+		inbox.clear();
+		stdin_done = false;
+		finishing = false;
+	}
+
+private:
+	//! What the coroutine is suspended on
+	enum class Wait { none, chunk, message, resume };
+
+	//! Starts the coroutine once the parameters are in, and collects stdin
+	void in_handler(const uchar* data, size_t len) final {
+		if (len)
+			chunks.emplace_back(data, data + len);
+		else
+			stdin_done = true;
+		if (step(Wait::chunk) && !finishing) {
+			// Only response() can complete the request
+			finishing = true;
+			protocol::Message m;
+			m.type = resume_type;
+			callback(m);
+		}
+	}
+
+	//! Resumes the coroutine with whatever the message is for
+	bool response() final {
+		switch (message.type) {
+		case 0:
+			// All of stdin is in, if there was any
+			stdin_done = true;
+			return step(Wait::chunk);
+		case resume_type: {
+			uint64_t t = 0;
+			if (message.size >= sizeof t)
+				std::memcpy(&t, message.data.get(), sizeof t);
+			// Anything but the latest token is left over from a wait that's over
+			return step(t && t == token ? Wait::resume : Wait::none);
+		}
+		default:
+			inbox.push_back(message);
+			return step(Wait::message);
+		}
+	}
+
+	/*! @brief Start the coroutine, or resume it if it's waiting on w
+	 * @param[in] w What has come in; Wait::chunk starts the coroutine
+	 * @return true once the coroutine has returned
+	 */
+	bool step(Wait w) {
+		if (!task) {
+			if (w != Wait::chunk)
+				return false;
+			task = run();
+		} else if (task.done() || w == Wait::none || waiting != w)
+			return task.done();
+		waiting = Wait::none;
+		task.resume();
+		return task.done();
+	}
+
+	//! Make a function that sends the request a message resuming the current wait
+	std::function<void()> resumer() {
+		// Unique across requests, so a message meant for one that's gone resumes nothing
+		static std::atomic<uint64_t> tokens(0);
+		uint64_t t = token = ++tokens;
+		std::function<void(protocol::Message)> cb = callback;
+		return [cb, t] () {
+			protocol::Message m(resume_type, sizeof t);
+			std::memcpy(m.data.get(), &t, sizeof t);
+			cb(m);
+		};
+	}
+
+	//! The coroutine
+	Task task;
+	//! What the coroutine is suspended on
+	Wait waiting;
+	//! Chunks of stdin not yet taken
+	std::deque<u_string> chunks;
+	//! Messages passed through callback not yet taken
+	std::deque<protocol::Message> inbox;
+	//! True once all of stdin is in
+	bool stdin_done;
+	//! True once the request has sent itself the message to complete it
+	bool finishing;
+	//! Token of the current wait on a resume_type message
+	uint64_t token;
+};
+
+MOSH_FCGI_END
+
+#endif
@@ -0,0 +1,176 @@
+//! @file  mosh/fcgi/env.hpp Defines the Env class
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_ENV_HPP
+#define MOSH_FCGI_ENV_HPP
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <mosh/fcgi/bits/str_ref.hpp>
+#include <mosh/fcgi/bits/u.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief The parameters of a request
+ *
+ * The PARAMS stream is kept as it came in, in one buffer, and the parameters are
+ * references into it, so none is copied. Iterating gives them in the order they
+ * were sent, as pairs of name and value.
+ *
+ * The standard CGI variables, and the common HTTP headers, are recognised by a
+ * perfect hash and indexed by Var, so looking them up takes constant time whether
+ * by Var or by name. Other names are looked up by going through the parameters.
+ *
+ * The references stay good until the request is done with.
+ */
+class Env {
+public:
+	typedef std::pair<Str_ref, Str_ref> value_type;
+	typedef std::vector<value_type>::const_iterator const_iterator;
+	typedef const_iterator iterator;
+
+	//! Well-known parameters
+	enum class Var : unsigned char {
+		auth_type,
+		content_length,
+		content_type,
+		document_root,
+		document_uri,
+		gateway_interface,
+		https,
+		http_accept,
+		http_accept_encoding,
+		http_accept_language,
+		http_authorization,
+		http_connection,
+		http_cookie,
+		http_host,
+		http_if_modified_since,
+		http_if_none_match,
+		http_referer,
+		http_user_agent,
+		path_info,
+		path_translated,
+		query_string,
+		remote_addr,
+		remote_host,
+		remote_port,
+		remote_user,
+		request_method,
+		request_scheme,
+		request_uri,
+		script_filename,
+		script_name,
+		server_addr,
+		server_name,
+		server_port,
+		server_protocol,
+		server_software,
+		//! Not a well-known parameter
+		none
+	};
+	//! Number of well-known parameters
+	static const size_t vars = static_cast<size_t>(Var::none);
+
+	/*! @brief Recognise a well-known parameter
+	 * @param[in] name Name of the parameter
+	 * @return Its Var; Var::none if it's not one
+	 */
+	static Var var(Str_ref name);
+	//! Name of a well-known parameter, such as "REQUEST_METHOD"
+	static Str_ref name(Var v);
+
+	Env();
+
+	const_iterator begin() const { return params.begin(); }
+	const_iterator end() const { return params.end(); }
+	size_t size() const { return params.size(); }
+	bool empty() const { return params.empty(); }
+
+	/*! @brief Find a parameter
+	 * @param[in] name It's name
+	 * @return The first parameter of that name; end() if there is none
+	 */
+	const_iterator find(Str_ref name) const;
+	//! Number of parameters of a name, counting the first only
+	size_t count(Str_ref name) const { return find(name) != end(); }
+	//! Value of a parameter; empty if there is none
+	Str_ref operator [] (Str_ref name) const;
+	//! Value of a well-known parameter; empty if there is none
+	Str_ref operator [] (Var v) const;
+	//! Test if a well-known parameter has been passed
+	bool has(Var v) const { return index[static_cast<size_t>(v)] != 0; }
+
+	/*! @name Typed accessors
+	 */
+	//@{
+	//! CONTENT_LENGTH as a number; 0 if it's missing, not a number, or too big for a size_t
+	size_t content_length() const;
+	//! REQUEST_METHOD
+	Str_ref request_method() const { return (*this)[Var::request_method]; }
+	//! QUERY_STRING
+	Str_ref query_string() const { return (*this)[Var::query_string]; }
+	//! REQUEST_URI
+	Str_ref request_uri() const { return (*this)[Var::request_uri]; }
+	//! CONTENT_TYPE
+	Str_ref content_type() const { return (*this)[Var::content_type]; }
+	//! HTTP_COOKIE
+	Str_ref http_cookie() const { return (*this)[Var::http_cookie]; }
+	//@}
+
+	/*! @name Filling in
+	 *
+	 * For Request_base.
+	 */
+	//@{
+	//! Add the content of a PARAMS record
+	void append(const uchar* data, size_t size);
+	/*! @brief Parse what's been added, once the PARAMS stream is over
+	 *
+	 * A name-value pair cut short at the end is dropped.
+	 *
+	 * @param[in] keep Called with each parameter; those it returns false for are left out
+	 */
+	void parse(std::function<bool(value_type const&)> const& keep);
+	//! Drop the parameters, keeping the memory for the next request
+	void clear();
+	//@}
+
+private:
+	Env(Env const&) = delete;
+	Env& operator = (Env const&) = delete;
+
+	//! The PARAMS stream
+	std::string stream;
+	//! The parameters, referring into stream
+	std::vector<value_type> params;
+	//! One past the position in params of each well-known parameter; 0 for those not passed
+	std::array<unsigned, vars> index;
+};
+
+MOSH_FCGI_END
+
+#endif
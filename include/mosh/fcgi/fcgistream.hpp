@@ -26,11 +26,14 @@
 #include <ostream>
 #include <ios>
 #include <istream>
+#include <functional>
 #include <memory>
 
 #include <mosh/fcgi/protocol/types.hpp>
 #include <mosh/fcgi/protocol/full_id.hpp>
 #include <mosh/fcgi/transceiver.hpp>
+#include <mosh/fcgi/bits/cancel_token.hpp>
+#include <mosh/fcgi/bits/str_ref.hpp>
 #include <mosh/fcgi/bits/namespace.hpp>
 
 MOSH_FCGI_BEGIN
@@ -46,7 +49,12 @@ public:
 	Fcgistream();
 	virtual ~Fcgistream();
 	//! Arguments passed directly to Fcgibuf::set()
-	void set(protocol::Full_id id, Transceiver& transceiver, protocol::Record_type type);
+	void set(protocol::Full_id id, Transceiver& transceiver, protocol::Record_type type, Cancel_token const* cancellation = nullptr);
+	/*! @brief Test if the request the stream belongs to has been cancelled
+	 *
+	 * Once it has, whatever is written to the stream is dropped.
+	 */
+	bool cancelled() const;
 	//! 
 	/*! @name Dumpers
 	 */
@@ -105,6 +113,31 @@ public:
 	 */
 	void dump(std::basic_istream<uchar>& stream);
 	//@}
+	/*! @brief Sends part of a file directly into the FastCGI protocol
+	 *
+	 * Anything written to the stream so far is flushed first. The data is then framed
+	 * in records whose payload is moved from the file into the socket by the kernel
+	 * (@c sendfile() where available) without ever being copied by us, which makes this
+	 * the fastest way to send a file.
+	 *
+	 * The file descriptor is duplicated, so it may be closed as soon as this returns. The
+	 * file must not be truncated before it has been transmitted; if it comes up short, the
+	 * connection is closed.
+	 *
+	 * @param[in] fd File descriptor of the file to send
+	 * @param[in] offset Offset in the file of the first byte to send
+	 * @param[in] length Amount of bytes to send
+	 * @throws std::system_error if fd can't be duplicated
+	 */
+	void send_file(int fd, off_t offset, size_t length);
+	/*! @brief Flush the stream, and have a function called once the output has gone out
+	 *
+	 * Never blocks; see Transceiver::when_drained().
+	 *
+	 * @param[in] f Function to call
+	 * @return true if the output has gone out already, in which case f is dropped
+	 */
+	bool when_drained(std::function<void()> f);
 
 private:
 	/*! @brief Stream buffer class for output of client data through FastCGI
@@ -129,6 +162,12 @@ Fcgistream& operator << (Fcgistream& os, std::string const& s);
  *  @return os
  */
 Fcgistream& operator << (Fcgistream& os, u_string const& us);
+/*! @brief Print a string to a Fcgistream
+ *  @param os The stream to print to
+ *  @param[in] s The string to print
+ *  @return os
+ */
+Fcgistream& operator << (Fcgistream& os, Str_ref s);
 /*! @brief Print a string to a Fcgistream
  *
  *  This function converts the wide string to a UTF-8 byte stream, then prints
@@ -0,0 +1,97 @@
+//! @file  mosh/fcgi/handoff.hpp Passing sockets to another process
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_HANDOFF_HPP
+#define MOSH_FCGI_HANDOFF_HPP
+
+#include <vector>
+
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief Restarting without refusing a single connection
+ *
+ * A process about to be replaced passes its listening socket, and the connections
+ * it has no request on, to its successor over a Unix socket, then finishes the
+ * requests it has in flight. The listening socket stays open throughout, so
+ * connections arriving meanwhile wait in its backlog for the new process.
+ *
+ * In the old process, before Manager::handler() is called:
+ * @code
+ * int hs = handoff::listen("/run/app.handoff");
+ * std::thread([&manager, hs] {
+ * 	int sock = accept(hs, NULL, NULL);
+ * 	if (sock >= 0)
+ * 		manager.hand_off(sock);
+ * }).detach();
+ * @endcode
+ *
+ * In the new process:
+ * @code
+ * std::vector<int> fds = handoff::take_over("/run/app.handoff");
+ * // With nobody to take over from, open the listening socket as usual
+ * int fd = fds.empty() ? open_listener() : fds[0];
+ * ManagerT<Req> manager(fd);
+ * for (size_t i = 1; i < fds.size(); ++i)
+ * 	manager.adopt(fds[i]);
+ * // ... then listen for the next process as above
+ * @endcode
+ */
+namespace handoff {
+	/*! @brief Listen on a Unix socket for a process to hand off to
+	 *
+	 * Whatever is at path is removed first.
+	 *
+	 * @param[in] path Path of the socket
+	 * @return File descriptor of the socket
+	 * @throws std::system_error if the socket can't be bound or listened on
+	 */
+	int listen(const char* path);
+	/*! @brief Take over from the process listening on a Unix socket
+	 *
+	 * Connects to path and receives what the process there sends with Manager::hand_off().
+	 *
+	 * @param[in] path Path of the socket
+	 * @return The listening socket, followed by connections to serve; empty if nobody is
+	 * 	listening on path, or the process there didn't hand off
+	 * @throws std::system_error if the transfer breaks off
+	 */
+	std::vector<int> take_over(const char* path);
+	/*! @brief Send file descriptors over a connected Unix socket
+	 *
+	 * The descriptors stay open on our end.
+	 *
+	 * @param[in] sock The socket
+	 * @param[in] fds File descriptors to send
+	 * @throws std::system_error if sending fails
+	 */
+	void send(int sock, std::vector<int> const& fds);
+	/*! @brief Receive file descriptors sent with send()
+	 * @param[in] sock The socket
+	 * @return The file descriptors; empty if the socket was closed before any were sent
+	 * @throws std::system_error if receiving fails or breaks off
+	 */
+	std::vector<int> receive(int sock);
+}
+
+MOSH_FCGI_END
+
+#endif
@@ -96,6 +96,10 @@ public:
 	//! Destructor
 	virtual ~Cookie()
 	{ }
+	//! Copy assignment
+	Cookie& operator = (const Cookie& cookie) = default;
+	//! Move assignment
+	Cookie& operator = (Cookie&& cookie) = default;
 	/*! @brief Create a partially-specified cookie for deletion
 	 *  @param[in] name_ cookie name
 	 *  @param[in] domain_ a domain for which this cookie is valid
@@ -87,6 +87,16 @@ public:
 	 * @param[in] size Size of data in bytes
 	 */
 	void fill_post(const uchar* data, size_t size);
+
+	//! Forget everything parsed so far, to start over with another request
+	virtual void clear() {
+		Session_base<char_type>::clear();
+		posts.clear();
+		mm_posts.clear();
+		multipart = false;
+		ue_vars.reset();
+		mp_vars.reset();
+	}
 protected:
 	//! Prepare this %Session for @c application/x-www-formurl-encoded POSTDATA
 	bool init_ue();
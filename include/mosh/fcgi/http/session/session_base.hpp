@@ -68,6 +68,16 @@ public:
 	 */
 	void parse_param(std::pair<std::string, std::string> const& p);
 
+	//! Forget everything parsed so far, to start over with another request
+	virtual void clear() {
+		gets.clear();
+		cookies.clear();
+		cookies_g = Cookie();
+		ubuf.clear();
+		ebuf.clear();
+		conv.reset();
+	}
+
 protected:
 	Session_base ()  { }
 
@@ -72,8 +72,8 @@ u_string Session_base<ct>::process_encoded_data() {
 		ret = std::move(this->conv->in(this->ebuf.data(), this->ebuf.data() + this->ebuf.size(), f_next));
 		this->ebuf.erase(0, f_next - this->ebuf.data());
 	} else { // null converter; bitwisedly copy
-		ret = std::move(u_string(sign_cast<const uchar*>(this->ebuf.data()),
-						sign_cast<const uchar*>(this->ebuf.data()) + this->ebuf.size()));
+		ret = std::move(u_string(sign_cast<const uchar*>(this->ebuf.c_str()),
+						sign_cast<const uchar*>(this->ebuf.c_str()) + this->ebuf.size()));
 		this->ebuf.clear();
 	}
 		return ret;
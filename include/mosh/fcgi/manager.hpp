@@ -25,11 +25,16 @@
 
 #include <map>
 #include <string>
-#include <queue>
+#include <deque>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <memory>
 #include <stdexcept>
+#include <thread>
 #include <type_traits>
+#include <vector>
 #include <cstring>
 
 #include <signal.h>
@@ -40,7 +45,10 @@
 #include <mosh/fcgi/protocol/full_id.hpp>
 #include <mosh/fcgi/protocol/message.hpp>
 #include <mosh/fcgi/transceiver.hpp>
+#include <mosh/fcgi/bits/lanes.hpp>
 #include <mosh/fcgi/bits/locked.hpp>
+#include <mosh/fcgi/bits/mpsc_queue.hpp>
+#include <mosh/fcgi/bits/request_table.hpp>
 #include <mosh/fcgi/bits/namespace.hpp>
 
 MOSH_FCGI_BEGIN
@@ -55,12 +63,34 @@ namespace stdph = std::placeholders;
  * response() function defined. To operate this class all that needs to be
  * done is creating an object and calling handler() on it.
  *
+ * Any number of managers may exist at once, each with its own Transceiver and
+ * thread. SIGTERM and SIGUSR1 are passed on to every one of them.
+ *
  * @tparam T Class that will handle individual requests. Should be derived from
  * the Request class.
  */
 class Manager {
 	
 public:
+	/*! @brief Limits on the work a %Manager takes on
+	 *
+	 * These are the values reported to the other side in answer to a
+	 * FCGI_GET_VALUES record, and they are enforced:
+	 *  - no new connection is accepted while max_conns are open;
+	 *  - a request beyond max_reqs is refused with Protocol_status::overloaded;
+	 *  - unless mpxs_conns is set, a request on a connection that already has one
+	 *    active is refused with Protocol_status::cant_mpx_conn.
+	 */
+	struct Limits {
+		Limits() : max_conns(0), max_reqs(0), mpxs_conns(true) { }
+		//! Maximum number of connections open at once (FCGI_MAX_CONNS); 0 for no limit
+		size_t max_conns;
+		//! Maximum number of requests active at once (FCGI_MAX_REQS); 0 for no limit
+		size_t max_reqs;
+		//! Accept concurrent requests over one connection (FCGI_MPXS_CONNS)
+		bool mpxs_conns;
+	};
+
 	//! Construct from a file descriptor
 	/*!
 	 * The only piece of data required to construct a %Manager object is a
@@ -71,8 +101,17 @@ public:
 	 *
 	 * @param[in] fd File descriptor to listen on.
 	 * @param new_req New request handler
+	 * @param[in] options Transceiver tunables
+	 * @param[in] limits Limits on connections and requests
+	 * @param[in] workers Number of worker threads to run requests in. With none, requests
+	 * 	are run by handler() itself, in between doing I/O.
+	 * @param[in] pool_size Number of finished requests kept for reuse. A request is
+	 * 	Request_base::reset() before going back to the pool; with a pool_size of 0, each
+	 * 	request is made by new_req and deleted once finished.
 	 */
-	Manager(int fd = 0, std::function<Request_base*()> new_req = []() -> Request_base* { throw std::invalid_argument("Attempt to instantiate Request_base"); });
+	Manager(int fd = 0, std::function<Request_base*()> new_req = []() -> Request_base* { throw std::invalid_argument("Attempt to instantiate Request_base"); },
+			Transceiver::Options const& options = Transceiver::Options(), Limits const& limits = Limits(),
+			size_t workers = 0, size_t pool_size = 0);
 	virtual ~Manager();
 
 	//! General handling function to be called after construction
@@ -81,6 +120,14 @@ public:
 	 * requests until either the stop() function is called (obviously from another
 	 * thread) or the appropriate signals are caught.
 	 *
+	 * If the %Manager has worker threads, this thread only does I/O and management
+	 * records, while the workers run the requests. The messages of any one request are
+	 * still handled one at a time and in order, though not always by the same worker.
+	 *
+	 * Which request is handled next is up to its Lane. Management records and requests
+	 * the other side aborted go first; a request whose input is all in goes before those
+	 * still receiving theirs, which take turns by connection.
+	 *
 	 * @sa setup_signals()
 	 */
 	void handler();
@@ -126,25 +173,105 @@ public:
 	 */
 	void push(protocol::Full_id id, protocol::Message message);
 
+	/*! @brief Hand the listening socket and idle connections off to another process
+	 *
+	 * The next time round, handler() sends the listening socket, followed by the
+	 * connections with no request on them if @c connections is set, over sock with
+	 * handoff::send(), and closes sock. It then accepts no more connections and stops
+	 * serving the ones sent, and terminates as terminate() does once the requests in
+	 * flight are complete. Should sending fail, sock is closed and nothing changes.
+	 *
+	 * Safe to call from another thread or a signal handler.
+	 *
+	 * @param[in] sock Unix socket connected to the process taking over; see handoff::take_over()
+	 * @param[in] connections Pass idle connections along with the listening socket
+	 */
+	void hand_off(int sock, bool connections = true);
+
+	/*! @brief Serve a connection handed off by another process
+	 *
+	 * Call before handler(), or from the thread running it.
+	 *
+	 * @param[in] fd File descriptor of the connection
+	 */
+	void adopt(int fd) { transceiver.adopt(fd); }
+
 private:
 	//! Handles low level communication with the other side
 	Transceiver transceiver;
 	
-	//! Queue for pending tasks
-	Mutexed<std::queue<protocol::Full_id>> tasks;
-	
-	//! A queue of messages for the manager itself
-	Mutexed<std::queue<protocol::Message>> messages;
+	//! Finished requests ready for reuse
+	struct Pool {
+		Pool(size_t size) : size(size), closed(false) { }
+		//! Maximum number of requests in idle
+		size_t size;
+		//! Set once the Manager is destroyed, after which requests are deleted, not reset; guarded by idle
+		bool closed;
+		//! The requests
+		Mutexed<std::vector<std::unique_ptr<Request_base>>> idle;
+	};
+	/*! @brief Pool of requests; null if pool_size is 0
+	 *
+	 * Shared with the deleter of each request made by make_request(), so a request let go
+	 * of after the Manager is destroyed, by a timer thread say, finds it still there.
+	 * Declared ahead of every container of requests, tasks included, so it outlives them.
+	 */
+	std::shared_ptr<Pool> pool;
 
-	/*! @brief Associative container for active requests
+	//! Something for handler() to do
+	struct Task {
+		Task() : lane(Lane::bulk) { }
+		//! Handle the messages queued for a request
+		Task(std::shared_ptr<Request_base> const& request, Lane lane) : id(request->id), request(request), lane(lane) { }
+		//! Handle a management record
+		Task(protocol::Full_id id, protocol::Message message) : id(id), message(message), lane(Lane::urgent) { }
+		//! The request, or the connection of a management record if its request id is 0
+		protocol::Full_id id;
+		//! The management record; unused for requests, whose messages are queued with them
+		protocol::Message message;
+		//! The request; null for a management record
+		std::shared_ptr<Request_base> request;
+		//! Lane to schedule the task in
+		Lane lane;
+	};
+	/*! @brief Queue for pending tasks
 	 *
-	 * This container associated the protocol::Full_id of each active request with a pointer
-	 * to the actual Request object.
+	 * A request is in here, or in runnable, once for all the messages pushed to it
+	 * while it waits for its turn, which handles them all.
 	 */
-	Rw_locked<std::map<protocol::Full_id, std::shared_ptr<Request_base>>> requests;
+	Mpsc_queue<Task, 1024> tasks;
+	//! Tasks taken from tasks by handler(), in the order it gets to them
+	Lanes<Task> scheduled;
+
+	/*! @brief Container for active requests
+	 *
+	 * This container associates the protocol::Full_id of each active request with a pointer
+	 * to the actual Request object. Looking one up takes no lock.
+	 */
+	Request_table requests;
 
 	//! Handler for new requests
 	std::function<Request_base* ()> new_request;
+
+	//! Take a request from the pool, or make one with new_request if there are none
+	std::shared_ptr<Request_base> make_request();
+	/*! @brief Reset a finished request and put it in the pool, or delete it if the pool is full or closed
+	 * @param[in] pool The pool
+	 * @param[in] request The request; called as the deleter of those made by make_request()
+	 */
+	static void recycle(std::shared_ptr<Pool> const& pool, Request_base* request);
+
+	//! Limits on connections and requests
+	Limits limits;
+	//! Answers to FCGI_GET_VALUES queries, derived from limits
+	std::map<std::string, std::string> management_params;
+
+	/*! @brief Send an end_request record for a request that isn't going to be run
+	 * @param[in] id Full_id of the request
+	 * @param[in] status Reason for ending the request
+	 * @param[in] kill Boolean value indicating whether or not the connection should be closed afterwards
+	 */
+	void refuse(protocol::Full_id id, protocol::Protocol_status status, bool kill);
 	
 	//! Handles management messages
 	/*!
@@ -154,11 +281,45 @@ private:
 	 * file descriptor.
 	 *
 	 * @param[in] id Full_id associated with the messsage.
+	 * @param[in] msg The message
+	 */
+	void local_handler(protocol::Full_id id, protocol::Message const& msg);
+
+	/*! @brief Work out the lane of a request's next turn, given the message just pushed for it
+	 *
+	 * Cancels the request, or flags it as Request_base::input_done, as the message tells.
+	 *
+	 * @param[in] request The request
+	 * @param[in] message The message
+	 * @return The lane
 	 */
-	void local_handler(protocol::Full_id id);
+	Lane lane(Request_base& request, protocol::Message const& message);
 
-	//! Indicated whether or not the manager is currently in sleep mode
-	Mutexed_0<bool> asleep;
+	//! Threads running requests; empty if handler() runs them
+	std::vector<std::thread> workers;
+	//! Requests with messages waiting for a worker
+	Mutexed<Lanes<std::shared_ptr<Request_base>>> runnable;
+	//! Signalled when runnable grows or the workers are to quit
+	std::condition_variable work_ready;
+	//! Tells the workers to quit once runnable is empty; guarded by runnable
+	bool workers_quit;
+
+	//! Body of a worker thread
+	void work();
+	/*! @brief Handle a request's messages until there are none left or it completes
+	 * @param[in] request Request scheduled by push()
+	 */
+	void run(std::shared_ptr<Request_base> const& request);
+	//! Have the workers finish what's in runnable, and wait for them to quit
+	void join_workers();
+
+	/*! @brief Indicated whether or not the manager is currently in sleep mode
+	 *
+	 * Set before handler() takes a last look at the tasks and goes to sleep, and
+	 * looked at by push() after adding one, each with a full fence in between, so
+	 * either handler() sees the task or push() sees it asleep and wakes it up.
+	 */
+	std::atomic<bool> asleep;
 
 	/*! @brief The pthread id of the thread the handler() function is operating in.
 	 *
@@ -170,12 +331,25 @@ private:
 	/*!
 	 * @sa stop()
 	 */
-	Mutexed_0<bool> do_stop;
+	std::atomic<bool> do_stop;
 	//! Boolean value indication that handler() should terminate
 	/*!
 	 * @sa terminate()
 	 */
-	Mutexed_0<bool> do_terminate;
+	std::atomic<bool> do_terminate;
+	//! Socket to hand off over, or -1
+	/*!
+	 * @sa hand_off()
+	 */
+	std::atomic<int> handoff_sock;
+	//! Hand off idle connections along with the listening socket
+	std::atomic<bool> handoff_connections;
+
+	/*! @brief Do what hand_off() asked for
+	 * @param[in] sock Socket to hand off over
+	 * @param[in] connections Pass idle connections too
+	 */
+	void do_hand_off(int sock, bool connections);
 };
 
 /*! @brief A templated derivative of Manager
@@ -189,7 +363,9 @@ template <typename T>
 class ManagerT : public std::enable_if<std::is_base_of<Request_base, T>::value, Manager>::type {
 	friend class Manager;
 public:
-	ManagerT(int fd = 0) : Manager(fd, [](){ return new T; }) { }
+	ManagerT(int fd = 0, Transceiver::Options const& options = Transceiver::Options(), Manager::Limits const& limits = Manager::Limits(),
+			size_t workers = 0, size_t pool_size = 0)
+	: Manager(fd, [](){ return new T; }, options, limits, workers, pool_size) { }
 	virtual ~ManagerT() { }
 protected:
 		
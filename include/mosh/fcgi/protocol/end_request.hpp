@@ -48,7 +48,6 @@ namespace protocol {
 			app_status() = _app_status_;
 			protocol_status() = _proto_status_;
 		}
-		virtual ~End_request() { }
 
 		//! Get a setter for the request's return value
 		_s_u32 app_status() { return _s_u32(_app_status); }
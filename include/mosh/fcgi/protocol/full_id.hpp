@@ -48,14 +48,18 @@ namespace protocol {
 		 * @param [in] fd The file descriptor
 		 */
 		Full_id(Request_id fcgi_id, int fd)
-		: fcgi_id(fcgi_id), fd(fd)
-		{ }
+		: full(0)
+		{
+			// full is what gets compared, so the padding after fcgi_id must be zeroed first
+			this->fcgi_id = fcgi_id;
+			this->fd = fd;
+		}
 
 		Full_id(uint64_t f)
 		: full(f)
 		{ }
 
-		Full_id() { }
+		Full_id() : full(0) { }
 		union {
 			struct {
 				//! FastCGI Request ID
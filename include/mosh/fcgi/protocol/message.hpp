@@ -49,8 +49,17 @@ namespace protocol {
 		size_t size;
 		//! Pointer to the raw data being passed along with the message.
 		std::shared_ptr<uchar> data;
-		//! Default constructor. Initializes data's Deleter.
+		//! Default constructor. The message has no data.
 		Message();
+		/*! @brief Construct a message with room for data
+		 *
+		 * The data section is taken from Slab_pool::instance(), which is cheaper than
+		 * allocating it with @c new.
+		 *
+		 * @param[in] type Type of message
+		 * @param[in] size Size of the data section
+		 */
+		Message(unsigned type, size_t size);
 	};
 }
 
@@ -22,10 +22,12 @@
 #ifndef MOSH_FCGI_REQUEST_HPP
 #define MOSH_FCGI_REQUEST_HPP
 
+#include <atomic>
 #include <queue>
 #include <map>
 #include <string>
 #include <mutex>
+#include <new>
 #include <functional>
 #include <vector>
 
@@ -34,9 +36,14 @@
 #include <mosh/fcgi/protocol/full_id.hpp>
 #include <mosh/fcgi/protocol/message.hpp>
 #include <mosh/fcgi/transceiver.hpp>
+#include <mosh/fcgi/env.hpp>
 #include <mosh/fcgi/fcgistream.hpp>
 #include <mosh/fcgi/http/session.hpp>
+#include <mosh/fcgi/bits/cancel_token.hpp>
 #include <mosh/fcgi/bits/locked.hpp>
+#include <mosh/fcgi/bits/mpsc_queue.hpp>
+#include <mosh/fcgi/bits/rope.hpp>
+#include <mosh/fcgi/bits/spill_buffer.hpp>
 #include <mosh/fcgi/bits/u.hpp>
 #include <mosh/fcgi/bits/namespace.hpp>
 
@@ -60,6 +67,8 @@ MOSH_FCGI_BEGIN
  * * [pure] response() - When all the client data is received _or_ a non-FCGI message
  * 	is received, this function is called to process and produce a response
  *	or process the received message
+ * * streams_input() - When parameter parsing is complete, this function is called
+ * 	to ask whether response() should also run as the client data comes in
  *
  */
 class Request_base {
@@ -85,22 +94,66 @@ protected:
 	 */
 	Fcgistream err;
 
+	/*! @brief Cancelled as soon as the other side aborts the request
+	 *
+	 * Set when the FCGI_ABORT_REQUEST record comes in, ahead of anything still queued for
+	 * the request. From then on, whatever is written to out and err is dropped, and
+	 * messages not yet handled are discarded; the next time the request is handled, it
+	 * ends with an END_REQUEST record. A response that takes a while should poll
+	 * Cancel_token::cancelled(), or Cancel_token::subscribe() to it, to give up early.
+	 */
+	Cancel_token cancellation;
+
 	/*! @brief Response generator
 	 *
 	 * This function is called by handler() once all request data has been received from the other side or if a
-	 * Message not of a FastCGI type has been passed to it. The function shall return true if it has completed
-	 * the response and false if it has not (waiting for a callback message to be sent).
+	 * Message not of a FastCGI type has been passed to it, or earlier if streams_input() says so. The function
+	 * shall return true if it has completed the response and false if it has not (waiting for a callback
+	 * message to be sent, or for more input).
 	 *
 	 * @return Boolean value indication completion (true means complete)
 	 * @sa callback
 	 */
 	virtual bool response() = 0;
-	//! Handler for parsed PARAMS
-	virtual bool params_handler(std::pair<std::string, std::string> const& param) { return true; }
+	/*! @brief Whether to respond while the input is still coming in
+	 *
+	 * Called once the parameters are in, so the answer may depend on envs. If it returns
+	 * true, response() is called right away, and again after each IN and DATA record is
+	 * passed to in_handler() or data_handler(), so output can be written and flushed while
+	 * the body is still arriving. response() tells these calls apart from the last one with
+	 * input_complete(), and returns true only once the response is over; that ends the
+	 * request, and any input still to come is dropped.
+	 *
+	 * A streaming request should consume the records in in_handler() and data_handler()
+	 * rather than buffer the whole body.
+	 *
+	 * @return true to stream; false, the default, to call response() once all the input is in
+	 */
+	virtual bool streams_input() { return false; }
+	//! Whether all of the input, including FCGI_DATA for a filter, has been handled
+	bool input_complete() const { return state == protocol::Record_type::out; }
+	/*! @brief Handler for parsed PARAMS
+	 *
+	 * Called with each parameter once all of them are in.
+	 *
+	 * @param[in] param Name and value of the parameter
+	 * @return false to leave the parameter out of envs
+	 */
+	virtual bool params_handler(Env::value_type const& param) { return true; }
 	//! Handler for POSTDATA
 	virtual void in_handler(const uchar* data, size_t len) { }
 	//! Handler for FCGI_DATA
 	virtual void data_handler(const uchar* data, size_t len) { }
+
+	/*! @brief Get ready to handle another request
+	 *
+	 * Called by a Manager that pools requests once it's done with this one, from whichever
+	 * thread let go of it last, so the object can be handed out again. Derivations keeping
+	 * per-request data of their own should override it, clearing that data, and call the
+	 * function of their base class. Buffers should be cleared rather than freed, so they
+	 * keep their capacity.
+	 */
+	virtual void reset();
 	
 	/*! @brief The message associated with the current handler() call.
 	 *
@@ -125,7 +178,7 @@ protected:
 	 */
 	std::function<void(protocol::Message)> callback;
 	//! Request parameters
-	std::map<std::string, std::string> envs;
+	Env envs;
 
 	//! Dump FastCGI request parameters to string
 	/*! @note Does not dump message or envs
@@ -134,7 +187,18 @@ protected:
 private:
 	friend class Manager;
 	//! A queue of messages to be handled by the request
-	Mutexed<std::queue<protocol::Message>> messages;
+	Mpsc_queue<protocol::Message, 32> messages;
+	/*! @brief Number of messages pushed and not yet handled
+	 *
+	 * Whoever takes it from 0 to 1 schedules the request, and the Manager thread or worker
+	 * that gets it handles its messages in order until it's back down to 0, so a request
+	 * is owned by one thread at a time and is scheduled once per batch of messages.
+	 */
+	std::atomic<size_t> pending;
+	//! Set by complete() before the END_REQUEST record is written
+	std::atomic<bool> completed;
+	//! Set by Manager::push() once all of the input has come in
+	std::atomic<bool> input_done;
 	//! Pointer to the transceiver object that will send data to the other side
 	Transceiver* transceiver;
 	//! The role that the other side expects this request to play
@@ -145,8 +209,8 @@ private:
 	bool kill_con;
 	//! What the request is current doing
 	protocol::Record_type state;
-	//! Param buffer
-	u_string pbuf;
+	//! Whether response() is called as the input comes in; see streams_input()
+	bool streaming;
 
 	/*! @brief Request Handler
 	 *
@@ -174,20 +238,58 @@ private:
 	void set(protocol::Full_id id, Transceiver& transceiver, protocol::Role role, bool kill_con,
 			std::function<void(protocol::Message)> callback);
 
-	/*! @brief Fill params
-	 *  @param term Terminal mode (send blank kv to param_handler to signal end of args list)
-	 */
-	void fill_params(bool term);
+	//! Parse the parameters, passing each to params_handler(), once the PARAMS stream is over
+	void fill_params();
 };
 
+/*! @brief Append the content of a record to a buffer, by copying it
+ * @param buf The buffer; a container of bytes
+ * @param[in] data The content
+ * @param[in] len Size of the content
+ */
+template <typename Buf>
+void append_record(Buf& buf, const uchar* data, size_t len, protocol::Message const&) {
+	// Not reserve(size() + len), which would reallocate for every record
+	buf.insert(buf.end(), data, data + len);
+}
+
+/*! @brief Append the content of a record to a Rope, by sharing the record
+ * @param buf The rope
+ * @param[in] data The content, which lies in the data of message
+ * @param[in] len Size of the content
+ * @param[in] message The record
+ */
+inline void append_record(Rope& buf, const uchar* data, size_t len, protocol::Message const& message) {
+	buf.append(std::shared_ptr<const uchar>(message.data, data), len);
+}
+
+/*! @brief Append the content of a record to a Spill_buffer
+ *
+ * The record is shared while the buffer is in memory, and written out once it isn't.
+ *
+ * @param buf The buffer
+ * @param[in] data The content, which lies in the data of message
+ * @param[in] len Size of the content
+ * @param[in] message The record
+ */
+inline void append_record(Spill_buffer& buf, const uchar* data, size_t len, protocol::Message const& message) {
+	buf.append(std::shared_ptr<const uchar>(message.data, data), len);
+}
 
 
 /*! @brief %Request handling with rudimentary buffering
  *
  * Request_base with buffered IN and DATA.
  *
- * @tparam Post_buf Vector type for storing IN stream
- * @tparam Data_buf Vector type for storing DATA stream (when role == Role::filter)
+ * By default the bodies are copied into a std::vector as the records come in. With
+ * Rope buffers instead, the records are kept as they came in, and the bodies reach the
+ * application without being copied. To bound the memory a large upload takes, use
+ * Spill_buffer, which moves the body to a file past a threshold. Any other container
+ * of bytes with @c insert() and @c clear() will do as well; records are copied into
+ * those.
+ *
+ * @tparam Post_buf Type for storing IN stream
+ * @tparam Data_buf Type for storing DATA stream (when role == Role::filter)
  *
  * @see Request_base
  */
@@ -196,18 +298,14 @@ class Request : public virtual Request_base {
 protected:
 	//! Handler for IN records
 	virtual void in_handler(const uchar* data, size_t len) {
-		if (len > 0) {
-			post_buf.reserve(post_buf.size() + len);
-			std::copy(data, data + len, std::back_inserter(post_buf));
-		}
+		if (len > 0)
+			append_record(post_buf, data, len, this->message);
 		this->in_handler(len);
 	}
 	//! Handler for DATA records
 	virtual void data_handler(const uchar* data, size_t len) {
-		if (len > 0) {
-			data_buf.reserve(data_buf.size() + len);
-			std::copy(data, data + len, std::back_inserter(data_buf));
-		}
+		if (len > 0)
+			append_record(data_buf, data, len, this->message);
 		this->data_handler(len);
 	}
 	
@@ -237,6 +335,13 @@ protected:
 	 */
 	virtual void data_handler(size_t bytes_received) { }
 
+	//! Clear the IN and DATA buffers
+	virtual void reset() {
+		Request_base::reset();
+		post_buf.clear();
+		data_buf.clear();
+	}
+
 	//! IN buffer
 	Post_buf post_buf;
 	//! DATA buffer
@@ -262,9 +367,8 @@ protected:
 	http::Session<char_type, post_val_type> session;
 	
 	//! Handler for parsed PARAMS
-	virtual bool params_handler(std::map<std::string, std::string> const& env) {
-		for (auto const& e : env)
-			session.parse_param(e);
+	virtual bool params_handler(Env::value_type const& param) {
+		session.parse_param(std::make_pair(param.first.str(), param.second.str()));
 		return true;
 	}
 
@@ -275,6 +379,12 @@ protected:
 	}
 
 	virtual void in_handler(size_t) { }
+
+	//! Start over with a new session
+	virtual void reset() {
+		Request<std::vector<uchar>, data_buf_type>::reset();
+		session.clear();
+	}
 };
 
 MOSH_FCGI_END
@@ -0,0 +1,154 @@
+//! @file  mosh/fcgi/shards.hpp Defines the fcgi::Shards class
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef MOSH_FCGI_SHARDS_HPP
+#define MOSH_FCGI_SHARDS_HPP
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+extern "C" {
+#include <sys/socket.h>
+}
+
+#include <mosh/fcgi/manager.hpp>
+#include <mosh/fcgi/request.hpp>
+#include <mosh/fcgi/transceiver.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+/*! @brief A set of independent Manager objects, each running in its own thread
+ *
+ * A single %Manager drives all of its I/O and requests from one thread. To make use of
+ * more than one core, this class runs several of them side by side, sharing nothing
+ * but the way connections come in:
+ *  - either they all listen on the same socket, which the first to call @c accept()
+ *    for a new connection gets;
+ *  - or each of them listens on a socket of its own, bound to the same address with
+ *    @c SO_REUSEPORT, so the kernel spreads connections evenly over them. This needs
+ *    a TCP address.
+ *
+ * Each thread may be pinned to a core of its own.
+ */
+class Shards {
+public:
+	//! Tunables for a Shards
+	struct Options {
+		Options() : count(0), pin(true), backlog(SOMAXCONN), workers(0), pool_size(0) { }
+		//! Number of managers; 0 means one per core
+		size_t count;
+		//! Pin thread i to core i (modulo the number of cores)
+		bool pin;
+		//! Backlog of each socket opened with @c SO_REUSEPORT
+		int backlog;
+		//! Tunables for the transceiver of each manager
+		Transceiver::Options transceiver;
+		//! Limits enforced by each manager
+		Manager::Limits limits;
+		//! Worker threads of each manager; they aren't pinned
+		size_t workers;
+		//! Finished requests each manager keeps for reuse
+		size_t pool_size;
+	};
+
+	/*! @brief Construct managers sharing one listening socket
+	 *
+	 * @param[in] fd File descriptor to listen on. It's left open upon destruction.
+	 * @param new_req New request handler
+	 * @param[in] options Tunables
+	 */
+	Shards(int fd, std::function<Request_base*()> new_req, Options const& options = Options());
+	/*! @brief Construct managers each listening on a socket of their own
+	 *
+	 * A socket is opened for each manager with @c SO_REUSEPORT and bound to addr.
+	 * They are closed upon destruction.
+	 *
+	 * @param[in] addr Address to listen on
+	 * @param[in] addrlen Size of addr
+	 * @param new_req New request handler
+	 * @param[in] options Tunables
+	 * @throws std::system_error if a socket can't be opened, bound or listened on
+	 */
+	Shards(sockaddr const* addr, socklen_t addrlen, std::function<Request_base*()> new_req,
+			Options const& options = Options());
+	virtual ~Shards();
+
+	/*! @brief Run every manager until they have all halted
+	 *
+	 * Each Manager::handler() runs in a thread of its own; the calling thread only
+	 * waits for them.
+	 */
+	void handler();
+	//! Calls Manager::stop() on every manager
+	void stop();
+	//! Calls Manager::terminate() on every manager
+	void terminate();
+	//! Number of managers
+	size_t size() const { return managers.size(); }
+
+private:
+	Shards(Shards const&) = delete;
+	Shards& operator = (Shards const&) = delete;
+
+	//! Resolve Options::count
+	static size_t count(Options const& options);
+	/*! @brief Open a listening socket with @c SO_REUSEPORT
+	 * @param[in] addr Address to listen on
+	 * @param[in] addrlen Size of addr
+	 * @param[in] backlog Backlog of the socket
+	 * @return File descriptor of the socket
+	 */
+	static int listen_reuseport(sockaddr const* addr, socklen_t addrlen, int backlog);
+	//! Pin the calling thread to a core
+	static void pin(size_t core);
+
+	//! The managers
+	std::vector<std::unique_ptr<Manager>> managers;
+	//! Sockets opened by us
+	std::vector<int> sockets;
+	//! Pin threads to cores
+	bool pin_threads;
+};
+
+/*! @brief A templated derivative of Shards
+ *
+ *  This is a templated derivative class of %Shards that fills the new_req function with
+ *  @c new @c T.
+ *
+ *  @tparam T Request handling class; must be derived from Request_base
+ */
+template <typename T>
+class ShardsT : public std::enable_if<std::is_base_of<Request_base, T>::value, Shards>::type {
+public:
+	ShardsT(int fd, Shards::Options const& options = Shards::Options())
+	: Shards(fd, [](){ return new T; }, options) { }
+	ShardsT(sockaddr const* addr, socklen_t addrlen, Shards::Options const& options = Shards::Options())
+	: Shards(addr, addrlen, [](){ return new T; }, options) { }
+	virtual ~ShardsT() { }
+};
+
+MOSH_FCGI_END
+
+#endif
@@ -23,14 +23,22 @@
 #ifndef MOSH_FCGI_TRANSCEIVER_HPP
 #define MOSH_FCGI_TRANSCEIVER_HPP
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <vector>
 extern "C" {
-#include <poll.h>
+#include <sys/types.h>
 }
 
 #include <mosh/fcgi/bits/block.hpp>
+#include <mosh/fcgi/bits/cancel_token.hpp>
+#include <mosh/fcgi/bits/poller.hpp>
 #include <mosh/fcgi/bits/types.hpp>
 #include <mosh/fcgi/protocol/header.hpp>
 #include <mosh/fcgi/protocol/message.hpp>
@@ -42,6 +50,9 @@ MOSH_FCGI_BEGIN
 /*!
  * This class handles the sending/receiving/buffering of data through the OS level sockets and also
  * the creation/destruction of the sockets themselves.
+ *
+ * Output may be written from any thread. Sockets and the poller are only ever touched by the
+ * thread running handler(); output written from another thread is handed over to it.
  */
 class Transceiver {
 public:
@@ -55,12 +66,168 @@ public:
 	 */
 	bool handler();
 
+	/*! @name Output
+	 *
+	 * Requests on a connection may be written to from several threads at once, so each
+	 * record has to be queued in one go: a block from request_write() holding the whole
+	 * record, passed to secure_write(), or one holding the header of a record whose
+	 * content is in a file, passed to secure_file(). The block holds the transceiver
+	 * locked from request_write() on, so nothing else is written to the connection in
+	 * between. A record split over several such writes may be interleaved with others.
+	 */
 	//@{
-	//! Interface to Buffer::request_write()
-	Block request_write(size_t size);
-	//! Interface to Buffer::secure_write()
-	void secure_write(size_t size, protocol::Full_id id, bool kill);
+	/*! @brief Request a write block in the output buffer of a connection
+	 *
+	 * The block holds the transceiver locked until it's passed to secure_write() or
+	 * secure_file(), or destroyed unwritten.
+	 *
+	 * @param[in] size Requested size of write block
+	 * @param[in] id Complete ID of the request (contains the file descriptor)
+	 * @return Block of writable memory. Size may be less than requested
+	 */
+	Block request_write(size_t size, protocol::Full_id id);
+	/*! @brief Secure a write in the output buffer of a connection
+	 *
+	 * The data is transmitted right away unless the connection is known to be
+	 * full, in which case it waits for @c POLLOUT. Off the thread running handler(),
+	 * it's left for that thread to transmit, which is woken up if need be.
+	 *
+	 * @param block Block returned by request_write(); the transceiver is unlocked upon return
+	 * @param[in] size Amount of bytes to secure
+	 * @param[in] id Complete ID of the request (contains the file descriptor)
+	 * @param[in] kill Boolean value indicating whether or not the file descriptor should be closed after transmission
+	 */
+	void secure_write(Block& block, size_t size, protocol::Full_id id, bool kill);
+	//! Test if all buffered output has been transmitted
+	bool empty() const;
+	/*! @brief Tell the transceiver a request on a connection is over
+	 *
+	 * A connection the other side has hung up on is kept open, though no longer served,
+	 * while requests are active on it, so its number isn't reused under them. It's
+	 * closed here once in_use says the last of them is gone.
+	 *
+	 * @param[in] fd File descriptor of the connection
+	 */
+	void request_over(int fd);
 	//@}
+
+	/*! @name Backpressure
+	 *
+	 * Once more than Options::high_water bytes of output are buffered for a connection,
+	 * no more is read from it until they are down to Options::low_water. Backpressure is
+	 * off by default.
+	 */
+	//@{
+	/*! @brief Hold up a request until its connection's buffered output is back down to the low water mark
+	 *
+	 * Returns right away unless the connection is above the high water mark. Off the
+	 * thread running handler(), this waits for that thread to flush the connection,
+	 * stalling the calling thread. If the other side takes no data for
+	 * Options::send_timeout meanwhile, the connection is shut down and its output
+	 * dropped. On the thread running handler(), which can't wait without stalling every
+	 * other connection, the connection is flushed as far as it takes data right away, and
+	 * the rest is left for handler(). Fcgistream calls this after each record it writes.
+	 *
+	 * A request cancelled meanwhile stops the wait, as long as its token calls
+	 * cancelled_throttle() when it's cancelled; Request_base::set() sees to that.
+	 *
+	 * @param[in] id Complete ID of the request (contains the file descriptor)
+	 * @param[in] cancellation Token of the request, if any
+	 */
+	void throttle(protocol::Full_id id, Cancel_token const* cancellation = nullptr);
+	//! Wake the threads waiting in throttle(), so those whose requests were cancelled give up
+	void cancelled_throttle();
+	/*! @brief Have a function called once a connection's buffered output is down to the low water mark
+	 *
+	 * The non-blocking counterpart of throttle(). Unless the connection is already down
+	 * to Options::low_water (0 with backpressure off), f is kept and called by the thread
+	 * running handler() once enough has been transmitted, or the connection is gone. It's
+	 * called with the transceiver locked, so it should do no more than pass on a message.
+	 *
+	 * @param[in] id Complete ID of the request (contains the file descriptor)
+	 * @param[in] f Function to call
+	 * @return true if the connection is down to the low water mark already, in which case
+	 * 	f is dropped
+	 */
+	bool when_drained(protocol::Full_id id, std::function<void()> f);
+	//! Number of bytes of output buffered for all connections
+	size_t buffered() const;
+	//! Number of bytes of output buffered for a connection
+	size_t buffered(int fd) const;
+	//@}
+
+	/*! @name Hand-off
+	 *
+	 * For passing the listening socket and connections to another process. These may
+	 * only be called from the thread running handler(), or before it first runs.
+	 */
+	//@{
+	//! File descriptor of the listening socket
+	int listener() const { return socket; }
+	//! Stop accepting connections for good; those already open are still served
+	void stop_accepting();
+	//! File descriptors of connections with no partial record received and no output buffered
+	std::vector<int> idle_connections() const;
+	//! Stop serving a connection, leaving its file descriptor open
+	void release(int fd);
+	//! Serve a connection accepted elsewhere, such as by another process
+	void adopt(int fd);
+	//@}
+
+	//! A file to transmit segments of. The file descriptor is closed with the object.
+	class File {
+	public:
+		//! Takes ownership of fd
+		explicit File(int fd) : fd(fd) { }
+		~File();
+		//! Get the file descriptor
+		int get() const { return fd; }
+	private:
+		File(File const&) = delete;
+		File& operator = (File const&) = delete;
+		//! File descriptor
+		int fd;
+	};
+	/*! @brief Queue a record whose content is a segment of a file
+	 *
+	 * The segment is moved from the file into the socket by the kernel, without being
+	 * copied into the output buffer. The header, the segment and the padding are queued
+	 * together, so no other record on the connection can come between them.
+	 *
+	 * @param header Block returned by request_write(), holding the record header; the
+	 * 	transceiver is unlocked upon return
+	 * @param[in] header_size Size of the header
+	 * @param[in] file File to transmit from
+	 * @param[in] offset Offset in the file of the first byte to transmit
+	 * @param[in] size Amount of bytes to transmit
+	 * @param[in] padding Amount of zero bytes to pad the record with
+	 * @param[in] id Complete ID of the request (contains the file descriptor)
+	 */
+	void secure_file(Block& header, size_t header_size, std::shared_ptr<File> file, off_t offset, size_t size,
+			size_t padding, protocol::Full_id id);
+
+	//! Tunables for a Transceiver
+	struct Options {
+		Options() : backend(Poller::Backend::automatic), read_buffer_size(16384), accept_cap(256),
+			high_water(0), low_water(0), send_timeout(30000) { }
+		//! Readiness notification backend
+		Poller::Backend backend;
+		//! Size of the per-connection receive buffer filled by each read()
+		size_t read_buffer_size;
+		//! Maximum number of connections accepted per wakeup; the rest wait for the next one
+		size_t accept_cap;
+		/*! @brief Buffered output per connection above which backpressure is applied; 0 for none
+		 *
+		 * @note Without worker threads, throttle() runs on the thread doing all the I/O and
+		 * 	can't hold up the request writing, so only reading from the connection stops.
+		 * 	A request that writes a lot should then wait for when_drained() between writes.
+		 */
+		size_t high_water;
+		//! Buffered output per connection below which backpressure is released; 0 for a quarter of high_water
+		size_t low_water;
+		//! Milliseconds throttle() waits, off the I/O thread, for the other side to make progress before dropping the connection; -1 for ever
+		int send_timeout;
+	};
 	
 	//! Constructor
 	/*!
@@ -69,50 +236,211 @@ public:
 	 *
 	 * @param[in] fd File descriptor to listen for connections on
 	 * @param[in] send_message Function to call to pass messages to requests
+	 * @param[in] options Tunables
+	 * @param[in] max_conns Maximum number of connections open at once; 0 for no limit
+	 * @param[in] in_use Function telling whether any request is still active on a connection;
+	 * 	without one, a connection the other side hangs up on is closed right away
 	 */
-	Transceiver(int fd, std::function<void(protocol::Full_id, protocol::Message)> send_message);
+	Transceiver(int fd, std::function<void(protocol::Full_id, protocol::Message)> send_message,
+			Options const& options = Options(), size_t max_conns = 0,
+			std::function<bool(int)> in_use = nullptr);
 
 	virtual ~Transceiver();
 	//@{
 	//! Blocks until there is data to receive or a call to wake() is made
 	void sleep();
 
-	//! Forces a wakeup from a call to sleep()
+	//! Forces a wakeup from a call to sleep(); safe to call from a signal handler
 	void wake();
 	//@}
 
 private:
-	//! %Buffer type for receiving FastCGI records
+	/*! @brief %Buffer type for receiving FastCGI records
+	 *
+	 * Each connection reads into its own buffer, as much as the socket holds at once.
+	 * Complete records are handed out as Message objects sharing ownership of the
+	 * buffer, so they're never copied. A buffer is only rewritten when no Message
+	 * refers to it any more; otherwise a fresh one is allocated for the next read.
+	 */
 	struct Fd_buffer {
-		//! Buffer for header information
-		protocol::Header header_buffer;
-		//! Buffer of complete Message
-		protocol::Message message_buffer;
+		Fd_buffer() : capacity(0), begin(0), end(0) { }
+		//! Received data
+		std::shared_ptr<uchar> data;
+		//! Size of data
+		size_t capacity;
+		//! Offset of the first byte not yet handed out as a Message
+		size_t begin;
+		//! Offset of 1+ the last received byte
+		size_t end;
 	};
 
 	//! %Buffer type for transmission of FastCGI records
 	class Buffer;
 
-	//! %Buffer for transmitting data
-	std::unique_ptr<Buffer> pbuf;
+	//! State of a connection to the other side
+	struct Connection {
+		Connection();
+		~Connection();
+		Connection(Connection&&);
+		Connection& operator = (Connection&&);
+		//! Received data
+		Fd_buffer in;
+		//! Data waiting to be transmitted; allocated upon the first write
+		std::unique_ptr<Buffer> out;
+		//! True if the socket is full and we're waiting for @c POLLOUT
+		bool blocked;
+		//! True if the connection is listed in writable
+		bool queued;
+		//! True if we've stopped reading from the connection, its output being above the high water mark
+		bool paused;
+		//! Events the poller was last told to watch for
+		short interest;
+		//! Functions to call once out is down to the low water mark
+		std::vector<std::function<void()>> drain_waiters;
+	};
+
+	//! Readiness notification backend
+	std::unique_ptr<Poller> poller;
+	/*! @brief Readiness events not yet serviced
+	 *
+	 * Events harvested by sleep() are kept here for the next call to handler(), since an
+	 * edge-triggered backend won't report them a second time.
+	 */
+	std::vector<Poller::Event> events;
+
+	//! Chunks released by output buffers, kept for reuse
+	std::vector<std::unique_ptr<uchar[]>> spare_chunks;
+	//! Sink for output to connections that have been hung up on
+	std::vector<uchar> discard;
 	
 	//! Function to call to pass messages to requests
 	std::function<void (protocol::Full_id, protocol::Message)> send_message;
+	//! Function telling whether any request is still active on a connection
+	std::function<bool (int)> in_use;
+	//! Connections hung up on and still open for the requests active on them
+	std::set<int> orphans;
 
-	//! poll() file descriptors container
-	std::vector<pollfd> poll_fds;
 	//! Socket to listen for connections on
 	int socket;
-	//! Input file descriptor to the wakeup socket pair
+	//! File descriptor polled for wakeups; an eventfd where available, else one end of a socket pair
 	int wakeup_fd_in;
-	//! Output file descriptor to the wakeup socket pair
+	//! File descriptor written to by wake(); the same as wakeup_fd_in for an eventfd
 	int wakeup_fd_out;
 
-	//! Container associating file descriptors with their receive buffers
-	std::map<int, Fd_buffer> fd_buffers;
+	//! Container associating file descriptors with their connection state
+	std::map<int, Connection> connections;
+	/*! @brief Connections with output ready to be transmitted
+	 *
+	 * Served round-robin by transmit(), so a connection with a lot of output can't
+	 * starve the others.
+	 */
+	std::deque<int> writable;
+	//! Default size of receive buffers
+	size_t read_buffer_size;
+	//! Maximum number of connections accepted per call to accept_connections()
+	size_t accept_cap;
+	//! High water mark of buffered output per connection
+	size_t high_water;
+	//! Low water mark of buffered output per connection
+	size_t low_water;
+	//! Timeout of throttle() in milliseconds
+	int send_timeout;
+	//! Maximum number of connections open at once
+	size_t max_conns;
+	//! True while the listening socket is watched for connections
+	bool accepting;
+	//! False once stop_accepting() has been called
+	bool listening;
+	//! True while received records are being passed to send_message, during which nothing is transmitted
+	bool dispatching;
+	//! True while sleep() waits on the poller, so output secured by another thread has to wake it up
+	bool parked;
+
+	/*! @brief Guards all of the above against concurrent writers
+	 *
+	 * Recursive, as records received by handler() may be answered from within send_message.
+	 */
+	mutable std::recursive_mutex state_lock;
+	//! Signalled whenever a connection drops to the low water mark or goes away
+	std::condition_variable_any drained;
+	//! The thread last running handler(), which alone may touch sockets and the poller
+	std::thread::id io_thread;
 
-	//! Transmit all buffered data possible
+	/*! @brief Give each connection listed in writable one go at transmitting
+	 * @return true if no connection is left that can be transmitted to right now
+	 */
 	int transmit();
+	/*! @brief Transmit as much of a connection's output as a single writev() takes
+	 *
+	 * The connection is relisted in writable if there is more to go, or made to wait
+	 * for @c POLLOUT if the socket is full.
+	 *
+	 * @param[in] fd File descriptor of the connection
+	 * @param[in,out] connection State of the connection
+	 */
+	void flush(int fd, Connection& connection);
+	/*! @brief Move part of a file segment into a socket
+	 *
+	 * Uses sendfile() where available, and pread() followed by write() elsewhere.
+	 *
+	 * @param[in] fd Socket to transmit to
+	 * @param[in] file File to transmit from
+	 * @param[in] offset Offset in the file to transmit from
+	 * @param[in] size Maximum amount of bytes to transmit
+	 * @return Amount of bytes transmitted, 0 if the file ended, or -1 on error with errno set
+	 */
+	static ssize_t send_file(int fd, int file, off_t offset, size_t size);
+	//! Flush a connection, or schedule it if that can't be done right now or from this thread
+	void transmit_soon(int fd, Connection& connection);
+	//! Call and clear the drain waiters of a connection
+	static void notify_drained(Connection& connection);
+	//! List a connection in writable unless it already is
+	void schedule(int fd, Connection& connection);
+	//! Have the poller wake us up once a full connection has room again
+	void wait_writable(int fd, Connection& connection);
+	//! Resume transmitting to a connection that has room again
+	void writable_again(int fd);
+	//! Tell the poller which events we're interested in for a connection, given its state, if they've changed
+	void update_interest(int fd, Connection& connection);
+	/*! @brief Accept the connections waiting on the listening socket
+	 *
+	 * Connections are accepted until the backlog is empty or Options::accept_cap is
+	 * reached. They are made non-blocking and close-on-exec. Once max_conns connections
+	 * are open, the listening socket is ignored until one is gone.
+	 */
+	void accept_connections();
+	//! Start or stop watching the listening socket, depending on the number of connections
+	void update_accepting();
+	/*! @brief Receive from a connection until it would block
+	 *
+	 * Every complete record received is passed to send_message.
+	 *
+	 * @param[in] fd File descriptor of the connection
+	 * @param[in] revents Ready events reported for fd
+	 */
+	void receive(int fd, short revents);
+	/*! @brief Make room at the end of a receive buffer
+	 *
+	 * Unparsed data is moved to the front of the buffer if it isn't shared with any
+	 * Message, or else to a newly allocated buffer. The buffer is grown if it can't
+	 * hold the record at its front.
+	 *
+	 * @param[in,out] buffer Receive buffer
+	 * @return Number of bytes that can be read into the buffer
+	 */
+	size_t reserve_read(Fd_buffer& buffer);
+	/*! @brief Pass every complete record in a receive buffer to send_message
+	 * @param[in] fd File descriptor the buffer belongs to
+	 * @param[in,out] buffer Receive buffer
+	 */
+	void parse_records(int fd, Fd_buffer& buffer);
+	/*! @brief Forget about a connection the other side has hung up on
+	 *
+	 * It's closed unless requests are active on it, in which case request_over() closes it.
+	 */
+	void hang_up(int fd);
+	//! Close a connection at our end
+	void close_connection(int fd);
 };
 
 MOSH_FCGI_END
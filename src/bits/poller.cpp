@@ -0,0 +1,426 @@
+//! @file  bits/poller.cpp Readiness notification backends
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+extern "C" {
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#if defined(__linux__) && defined(MOSH_FCGI_USE_IO_URING)
+#include <endian.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+}
+
+#include <mosh/fcgi/exceptions.hpp>
+#include <mosh/fcgi/bits/poller.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+namespace {
+
+using MOSH_FCGI::Poller;
+
+//! %Poller backed by poll()
+class Poll_poller : public Poller {
+public:
+	void add(int fd, short events, bool) {
+		pollfd p;
+		p.fd = fd;
+		p.events = events;
+		p.revents = 0;
+		fds.push_back(p);
+	}
+
+	void modify(int fd, short events, bool) {
+		auto it = find(fd);
+		if (it != fds.end())
+			it->events = events;
+	}
+
+	void remove(int fd) {
+		auto it = find(fd);
+		if (it != fds.end())
+			fds.erase(it);
+	}
+
+	size_t wait(std::vector<Event>& ready, int timeout) {
+		int ret = poll(fds.data(), fds.size(), timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				return 0;
+			throw MOSH_FCGI::exceptions::Poll(errno);
+		}
+		size_t n = 0;
+		for (auto const& p : fds) {
+			if (p.revents) {
+				ready.push_back(Event(p.fd, p.revents));
+				if (++n == static_cast<size_t>(ret))
+					break;
+			}
+		}
+		return n;
+	}
+
+	Backend backend() const {
+		return Backend::poll;
+	}
+
+private:
+	std::vector<pollfd>::iterator find(int fd) {
+		return std::find_if(fds.begin(), fds.end(), [fd] (pollfd const& p) { return p.fd == fd; });
+	}
+
+	//! poll() file descriptors container
+	std::vector<pollfd> fds;
+};
+
+#ifdef __linux__
+
+//! %Poller backed by epoll(7)
+class Epoll_poller : public Poller {
+public:
+	Epoll_poller() : epfd(epoll_create1(EPOLL_CLOEXEC)) {
+		if (epfd < 0)
+			throw MOSH_FCGI::exceptions::Poll(errno);
+	}
+
+	~Epoll_poller() {
+		close(epfd);
+	}
+
+	void add(int fd, short events, bool edge) {
+		ctl(EPOLL_CTL_ADD, fd, events, edge);
+	}
+
+	void modify(int fd, short events, bool edge) {
+		ctl(EPOLL_CTL_MOD, fd, events, edge);
+	}
+
+	void remove(int fd) {
+		epoll_event ev = epoll_event();
+		// ENOENT and EBADF mean that the kernel has already forgotten about fd
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+	}
+
+	size_t wait(std::vector<Event>& ready, int timeout) {
+		int ret = epoll_wait(epfd, evs.data(), evs.size(), timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				return 0;
+			throw MOSH_FCGI::exceptions::Poll(errno);
+		}
+		for (int i = 0; i < ret; ++i) {
+			uint32_t e = evs[i].events;
+			short events = ((e & EPOLLIN) ? POLLIN : 0)
+					| ((e & EPOLLOUT) ? POLLOUT : 0)
+					| ((e & (EPOLLHUP | EPOLLRDHUP)) ? POLLHUP : 0)
+					| ((e & EPOLLERR) ? POLLERR : 0);
+			ready.push_back(Event(evs[i].data.fd, events));
+		}
+		return ret;
+	}
+
+	Backend backend() const {
+		return Backend::epoll;
+	}
+
+private:
+	void ctl(int op, int fd, short events, bool edge) {
+		epoll_event ev = epoll_event();
+		ev.data.fd = fd;
+		ev.events = ((events & POLLIN) ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0)
+				| ((events & POLLOUT) ? static_cast<uint32_t>(EPOLLOUT) : 0)
+				| (edge ? static_cast<uint32_t>(EPOLLET) : 0);
+		if (epoll_ctl(epfd, op, fd, &ev) < 0)
+			throw MOSH_FCGI::exceptions::Poll(errno);
+	}
+
+	//! Maximum number of events harvested by a single epoll_wait()
+	static const size_t max_events = 256;
+	//! epoll instance
+	int epfd;
+	//! Harvested events
+	std::array<epoll_event, max_events> evs;
+};
+
+#endif
+
+#if defined(__linux__) && defined(MOSH_FCGI_USE_IO_URING)
+
+//! %Poller backed by io_uring(7) poll requests
+/*!
+ * Each registered file descriptor has a one-shot @c IORING_OP_POLL_ADD in flight, which is
+ * armed again once it has completed, so notification is level-triggered. Registrations,
+ * changes and removals are only queued in the submission ring; they reach the kernel
+ * together with the io_uring_enter() that waits for completions.
+ *
+ * Requests carry the file descriptor and a generation number in their user data, so
+ * completions of requests that have since been removed or replaced can be told apart.
+ * Generation 0 marks requests whose completion is of no interest.
+ */
+class Uring_poller : public Poller {
+public:
+	Uring_poller() : ring_fd(-1), ring(MAP_FAILED), ring_size(0), sqes(MAP_FAILED), sqes_size(0), next_generation(1) {
+		io_uring_params p = io_uring_params();
+		ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+		if (ring_fd < 0)
+			throw MOSH_FCGI::exceptions::Poll(errno);
+		const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_POLL_32BITS;
+		if ((p.features & needed) != needed) {
+			release();
+			throw MOSH_FCGI::exceptions::Poll(ENOSYS);
+		}
+
+		ring_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+				p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+		ring = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+		sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+			int erno = errno;
+			release();
+			throw MOSH_FCGI::exceptions::Poll(erno);
+		}
+
+		char* r = static_cast<char*>(ring);
+		sq_head = reinterpret_cast<unsigned*>(r + p.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned*>(r + p.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned*>(r + p.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned*>(r + p.sq_off.array);
+		sq_entries = p.sq_entries;
+		cq_head = reinterpret_cast<unsigned*>(r + p.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned*>(r + p.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned*>(r + p.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(r + p.cq_off.cqes);
+	}
+
+	~Uring_poller() {
+		release();
+	}
+
+	void add(int fd, short events, bool) {
+		Registration& reg = regs[fd];
+		reg.events = events;
+		reg.generation = generation();
+		arm(fd, reg);
+	}
+
+	void modify(int fd, short events, bool) {
+		auto it = regs.find(fd);
+		if (it == regs.end() || it->second.events == events)
+			return;
+		cancel(fd, it->second);
+		it->second.events = events;
+		it->second.generation = generation();
+		arm(fd, it->second);
+	}
+
+	void remove(int fd) {
+		auto it = regs.find(fd);
+		if (it == regs.end())
+			return;
+		cancel(fd, it->second);
+		regs.erase(it);
+	}
+
+	size_t wait(std::vector<Event>& ready, int timeout) {
+		__kernel_timespec ts = __kernel_timespec();
+		if (timeout > 0) {
+			// Completes after timeout, or as soon as anything else does
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			io_uring_sqe& sqe = get_sqe();
+			sqe.opcode = IORING_OP_TIMEOUT;
+			sqe.addr = reinterpret_cast<uintptr_t>(&ts);
+			sqe.len = 1;
+			sqe.off = 1;
+		}
+
+		bool block = timeout && __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head;
+		if (block || unsubmitted())
+			if (enter(block) < 0) {
+				if (errno != EINTR && errno != EBUSY)
+					throw MOSH_FCGI::exceptions::Poll(errno);
+			}
+
+		size_t n = 0;
+		std::vector<int> rearm;
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			io_uring_cqe const& cqe = cqes[head & cq_mask];
+			uint32_t gen = cqe.user_data >> 32;
+			int fd = static_cast<int>(static_cast<uint32_t>(cqe.user_data));
+			if (!gen)
+				continue;
+			auto it = regs.find(fd);
+			if (it == regs.end() || it->second.generation != gen)
+				continue;
+			ready.push_back(Event(fd, cqe.res < 0 ? POLLERR : static_cast<short>(cqe.res)));
+			++n;
+			rearm.push_back(fd);
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		for (int fd : rearm)
+			arm(fd, regs[fd]);
+		return n;
+	}
+
+	Backend backend() const {
+		return Backend::io_uring;
+	}
+
+private:
+	//! A registered file descriptor
+	struct Registration {
+		//! Events of interest
+		short events;
+		//! Generation of the poll request in flight
+		uint32_t generation;
+	};
+
+	//! Unmap and close the ring
+	void release() {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size);
+		if (ring != MAP_FAILED)
+			munmap(ring, ring_size);
+		if (ring_fd >= 0)
+			close(ring_fd);
+	}
+
+	uint32_t generation() {
+		if (!++next_generation)
+			++next_generation;
+		return next_generation;
+	}
+
+	static uint64_t user_data(int fd, uint32_t gen) {
+		return (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+	}
+
+	//! Number of queued submissions the kernel hasn't picked up yet
+	unsigned unsubmitted() const {
+		return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	int enter(bool block) {
+		return syscall(__NR_io_uring_enter, ring_fd, unsubmitted(), block ? 1 : 0,
+				block ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+	}
+
+	//! Get a cleared submission queue entry, submitting the queued ones if the ring is full
+	io_uring_sqe& get_sqe() {
+		while (unsubmitted() == sq_entries)
+			if (enter(false) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+				throw MOSH_FCGI::exceptions::Poll(errno);
+		unsigned tail = *sq_tail;
+		unsigned index = tail & sq_mask;
+		io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+		sqe = io_uring_sqe();
+		sq_array[index] = index;
+		// The kernel only looks at the ring in io_uring_enter(), so the entry can be published before it's filled in
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		return sqe;
+	}
+
+	void arm(int fd, Registration const& reg) {
+		io_uring_sqe& sqe = get_sqe();
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.fd = fd;
+		uint32_t events = static_cast<unsigned short>(reg.events);
+#if __BYTE_ORDER == __BIG_ENDIAN
+		events = (events << 16) | (events >> 16);
+#endif
+		sqe.poll32_events = events;
+		sqe.user_data = user_data(fd, reg.generation);
+	}
+
+	void cancel(int fd, Registration const& reg) {
+		io_uring_sqe& sqe = get_sqe();
+		sqe.opcode = IORING_OP_POLL_REMOVE;
+		sqe.addr = user_data(fd, reg.generation);
+	}
+
+	//! Number of submission queue entries asked for
+	static const unsigned entries = 256;
+	//! io_uring instance
+	int ring_fd;
+	//! Mapping of the submission and completion rings
+	void* ring;
+	size_t ring_size;
+	//! Mapping of the submission queue entries
+	void* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	unsigned sq_entries;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe* cqes;
+	//! Last generation handed out
+	uint32_t next_generation;
+	//! Registered file descriptors
+	std::unordered_map<int, Registration> regs;
+};
+
+#endif
+
+}
+
+MOSH_FCGI_BEGIN
+
+std::unique_ptr<Poller> Poller::create(Backend backend) {
+#if defined(__linux__) && defined(MOSH_FCGI_USE_IO_URING)
+	if (backend == Backend::io_uring) {
+		try {
+			return std::unique_ptr<Poller>(new Uring_poller);
+		} catch (exceptions::Poll&) {
+			// fall through to epoll
+		}
+	}
+#endif
+#ifdef __linux__
+	if (backend == Backend::automatic || backend == Backend::epoll || backend == Backend::io_uring) {
+		try {
+			return std::unique_ptr<Poller>(new Epoll_poller);
+		} catch (exceptions::Poll&) {
+			// fall through to poll()
+		}
+	}
+#endif
+	return std::unique_ptr<Poller>(new Poll_poller);
+}
+
+MOSH_FCGI_END
@@ -0,0 +1,147 @@
+//! @file  bits/request_table.cpp Table of active requests
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <mosh/fcgi/request.hpp>
+#include <mosh/fcgi/bits/request_table.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+namespace {
+
+//! Entries of the first fd table
+const size_t initial_fds = 64;
+
+}
+
+MOSH_FCGI_BEGIN
+
+Request_table::Fds::Fds(size_t size_)
+	: size(size_), entries(new std::atomic<Connection*>[size_])
+{
+	for (size_t i = 0; i < size; ++i)
+		entries[i].store(nullptr, std::memory_order_relaxed);
+}
+
+Request_table::Request_table() : count(0) {
+	tables.emplace_back(new Fds(initial_fds));
+	fds.store(tables.back().get(), std::memory_order_release);
+}
+
+Request_table::~Request_table() { }
+
+Request_table::Connection* Request_table::connection(int fd) const {
+	Fds* t = fds.load(std::memory_order_acquire);
+	if (fd < 0 || static_cast<size_t>(fd) >= t->size)
+		return nullptr;
+	return t->entries[fd].load(std::memory_order_acquire);
+}
+
+Request_table::Connection& Request_table::make_connection(int fd) {
+	Fds* t = fds.load(std::memory_order_relaxed);
+	if (static_cast<size_t>(fd) >= t->size) {
+		size_t size = t->size;
+		while (size <= static_cast<size_t>(fd))
+			size *= 2;
+		std::unique_ptr<Fds> grown(new Fds(size));
+		for (size_t i = 0; i < t->size; ++i)
+			grown->entries[i].store(t->entries[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		// Readers may still be looking at t, so it's kept
+		t = grown.get();
+		tables.push_back(std::move(grown));
+		fds.store(t, std::memory_order_release);
+	}
+	Connection* c = t->entries[fd].load(std::memory_order_relaxed);
+	if (!c) {
+		connections.emplace_back(new Connection);
+		c = connections.back().get();
+		t->entries[fd].store(c, std::memory_order_release);
+	}
+	return *c;
+}
+
+std::shared_ptr<Request_base> Request_table::find(protocol::Full_id id) const {
+	Connection* c = connection(id.fd);
+	if (!c)
+		return nullptr;
+	if (id.fcgi_id < slots)
+		return std::atomic_load_explicit(&c->requests[id.fcgi_id], std::memory_order_acquire);
+	std::lock_guard<std::mutex> l(lock);
+	auto it = c->overflow.find(id.fcgi_id);
+	return it != c->overflow.end() ? it->second : nullptr;
+}
+
+void Request_table::insert(protocol::Full_id id, std::shared_ptr<Request_base> const& request) {
+	std::lock_guard<std::mutex> l(lock);
+	Connection& c = make_connection(id.fd);
+	bool replaced;
+	if (id.fcgi_id < slots)
+		replaced = std::atomic_exchange_explicit(&c.requests[id.fcgi_id], request, std::memory_order_acq_rel) != nullptr;
+	else {
+		std::shared_ptr<Request_base>& slot = c.overflow[id.fcgi_id];
+		replaced = slot != nullptr;
+		slot = request;
+	}
+	if (!replaced) {
+		c.count.fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void Request_table::erase(protocol::Full_id id, std::shared_ptr<Request_base> const& request) {
+	std::lock_guard<std::mutex> l(lock);
+	Connection* c = connection(id.fd);
+	if (!c)
+		return;
+	if (id.fcgi_id < slots) {
+		std::shared_ptr<Request_base>& slot = c->requests[id.fcgi_id];
+		if (std::atomic_load_explicit(&slot, std::memory_order_relaxed) != request)
+			return;
+		std::atomic_store_explicit(&slot, std::shared_ptr<Request_base>(), std::memory_order_release);
+	} else {
+		auto it = c->overflow.find(id.fcgi_id);
+		if (it == c->overflow.end() || it->second != request)
+			return;
+		c->overflow.erase(it);
+	}
+	c->count.fetch_sub(1, std::memory_order_relaxed);
+	count.fetch_sub(1, std::memory_order_release);
+}
+
+bool Request_table::any_of(int fd, std::function<bool(Request_base const&)> const& pred) const {
+	Connection* c = connection(fd);
+	if (!c || !c->count.load(std::memory_order_acquire))
+		return false;
+	for (auto const& slot : c->requests) {
+		std::shared_ptr<Request_base> request(std::atomic_load_explicit(&slot, std::memory_order_acquire));
+		if (request && pred(*request))
+			return true;
+	}
+	std::lock_guard<std::mutex> l(lock);
+	for (auto const& r : c->overflow)
+		if (pred(*r.second))
+			return true;
+	return false;
+}
+
+MOSH_FCGI_END
@@ -0,0 +1,86 @@
+//! @file  bits/rope.cpp Byte string made of shared slices
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include <mosh/fcgi/bits/rope.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+namespace {
+
+//! Allocate a buffer of bytes
+std::shared_ptr<MOSH_FCGI::uchar> allocate(size_t size) {
+	return std::shared_ptr<MOSH_FCGI::uchar>(new MOSH_FCGI::uchar[size], std::default_delete<MOSH_FCGI::uchar[]>());
+}
+
+}
+
+MOSH_FCGI_BEGIN
+
+void Rope::append(std::shared_ptr<const uchar> data, size_t size) {
+	if (!size)
+		return;
+	parts.push_back(Slice{std::move(data), size});
+	total += size;
+}
+
+void Rope::append(const uchar* data, size_t size) {
+	if (!size)
+		return;
+	std::shared_ptr<uchar> buffer(allocate(size));
+	std::memcpy(buffer.get(), data, size);
+	append(std::shared_ptr<const uchar>(std::move(buffer)), size);
+}
+
+void Rope::clear() {
+	parts.clear();
+	total = 0;
+}
+
+const uchar* Rope::data() {
+	if (parts.size() > 1) {
+		std::shared_ptr<uchar> buffer(allocate(total));
+		copy(buffer.get(), total);
+		parts.clear();
+		parts.push_back(Slice{std::shared_ptr<const uchar>(std::move(buffer)), total});
+	}
+	return parts.empty() ? nullptr : parts.front().data.get();
+}
+
+size_t Rope::copy(uchar* dest, size_t count, size_t pos) const {
+	size_t copied = 0;
+	for (auto const& s : parts) {
+		if (copied == count)
+			break;
+		if (pos >= s.size) {
+			pos -= s.size;
+			continue;
+		}
+		size_t n = std::min(s.size - pos, count - copied);
+		std::memcpy(dest + copied, s.data.get() + pos, n);
+		copied += n;
+		pos = 0;
+	}
+	return copied;
+}
+
+MOSH_FCGI_END
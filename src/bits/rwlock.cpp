@@ -85,7 +85,8 @@ void Rw_lock::unlock() noexcept {
 }
 
 void Rw_lock::upgrade_lock() {
-	std::lock_guard<std::mutex> up_lk(up_lock);
+	// Nothing may be held while waiting for the write lock, or two threads upgrading
+	// at once would each wait for the other's read lock to go
 	unlock();
 	write_lock();
 }
@@ -0,0 +1,140 @@
+//! @file  bits/slab_pool.cpp Size-class pool for message buffers
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <mosh/fcgi/bits/slab_pool.hpp>
+#include <mosh/fcgi/bits/types.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+#include <src/array_deleter.hpp>
+#include <src/namespace.hpp>
+
+namespace {
+
+//! Room left in each block for the control block in front of the data
+const size_t overhead = 64;
+//! Maximum number of bytes kept on the free list of each class
+const size_t max_cached = 4 << 20;
+
+//! Buffer of a size class, allocated together with its control block
+template <size_t N>
+struct Slab {
+	MOSH_FCGI::uchar data[N];
+};
+
+template <size_t N>
+std::shared_ptr<MOSH_FCGI::uchar> make_slab(MOSH_FCGI::Slab_pool& pool) {
+	std::shared_ptr<Slab<N>> slab(std::allocate_shared<Slab<N>>(MOSH_FCGI::Slab_pool::Allocator<Slab<N>>(pool)));
+	return std::shared_ptr<MOSH_FCGI::uchar>(slab, slab->data);
+}
+
+}
+
+MOSH_FCGI_BEGIN
+
+// 8 + 65535 + 255 bytes is the largest record there can be
+const std::array<size_t, Slab_pool::classes> Slab_pool::sizes = {{ 1024, 4096, 16384, 32768, 65800 }};
+
+Slab_pool::Slab_pool() { }
+
+Slab_pool& Slab_pool::instance() {
+	// Never destroyed, as buffers may be released during static destruction
+	static Slab_pool* pool = new Slab_pool;
+	return *pool;
+}
+
+std::shared_ptr<uchar> Slab_pool::allocate(size_t size, size_t& capacity) {
+	size_t i = 0;
+	while (i < classes && sizes[i] < size)
+		++i;
+	if (i == classes) {
+		++slabs[classes].misses;
+		capacity = size;
+		return std::shared_ptr<uchar>(new uchar[size], SRC::Array_deleter<uchar>());
+	}
+	capacity = sizes[i];
+	switch (i) {
+	case 0: return make_slab<1024>(*this);
+	case 1: return make_slab<4096>(*this);
+	case 2: return make_slab<16384>(*this);
+	case 3: return make_slab<32768>(*this);
+	default: return make_slab<65800>(*this);
+	}
+}
+
+size_t Slab_pool::class_of(size_t bytes) {
+	size_t i = 0;
+	while (i < classes && sizes[i] + overhead < bytes)
+		++i;
+	return i;
+}
+
+void* Slab_pool::get(size_t bytes) {
+	size_t i = class_of(bytes);
+	if (i == classes)
+		return ::operator new(bytes);
+	Class& slab = slabs[i];
+	{
+		std::lock_guard<std::mutex> lock(slab.lock);
+		if (!slab.free.empty()) {
+			void* p = slab.free.back();
+			slab.free.pop_back();
+			++slab.hits;
+			return p;
+		}
+	}
+	++slab.misses;
+	return ::operator new(sizes[i] + overhead);
+}
+
+void Slab_pool::put(void* p, size_t bytes) {
+	size_t i = class_of(bytes);
+	if (i < classes) {
+		Class& slab = slabs[i];
+		std::lock_guard<std::mutex> lock(slab.lock);
+		if (slab.free.size() < max_cached / sizes[i]) {
+			slab.free.push_back(p);
+			return;
+		}
+	}
+	::operator delete(p);
+}
+
+std::vector<Slab_pool::Stats> Slab_pool::stats() const {
+	std::vector<Stats> res;
+	for (size_t i = 0; i <= classes; ++i) {
+		Stats s;
+		s.size = i < classes ? sizes[i] : 0;
+		s.hits = slabs[i].hits;
+		s.misses = slabs[i].misses;
+		{
+			std::lock_guard<std::mutex> lock(slabs[i].lock);
+			s.cached = slabs[i].free.size();
+		}
+		res.push_back(s);
+	}
+	return res;
+}
+
+MOSH_FCGI_END
@@ -0,0 +1,238 @@
+//! @file  bits/spill_buffer.cpp Body buffer that moves to a file past a threshold
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <cstdlib>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+#include <mosh/fcgi/bits/spill_buffer.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+namespace {
+
+//! Create an anonymous file in directory, or a memfd if directory is empty
+int create_file(std::string const& directory) {
+#ifdef MFD_CLOEXEC
+	if (directory.empty()) {
+		int fd = memfd_create("mosh-fcgi-spill", MFD_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+		if (errno != ENOSYS)
+			throw std::system_error(errno, std::system_category(), "Spill_buffer: memfd_create");
+	}
+#endif
+	std::string dir(directory);
+	if (dir.empty()) {
+		const char* tmpdir = std::getenv("TMPDIR");
+		dir = (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+	}
+#ifdef O_TMPFILE
+	{
+		int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if (fd >= 0)
+			return fd;
+		// Not supported by the kernel or the file system; fall back to unlinking
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			throw std::system_error(errno, std::system_category(), "Spill_buffer: open " + dir);
+	}
+#endif
+	std::string path(dir + "/mosh-fcgi-spill.XXXXXX");
+	std::vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+	int fd = mkstemp(name.data());
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category(), "Spill_buffer: mkstemp " + path);
+	unlink(name.data());
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+}
+
+MOSH_FCGI_BEGIN
+
+Spill_buffer::Options& Spill_buffer::defaults() {
+	static Options options;
+	return options;
+}
+
+Spill_buffer::Spill_buffer(Options const& options)
+: threshold(options.threshold), directory(options.directory), fd(-1), map(nullptr), mapped(0), total(0) {
+}
+
+Spill_buffer::Spill_buffer(Spill_buffer&& b)
+: threshold(b.threshold), directory(std::move(b.directory)), memory(std::move(b.memory)),
+	fd(b.fd), map(b.map), mapped(b.mapped), total(b.total) {
+	b.memory.clear();
+	b.fd = -1;
+	b.map = nullptr;
+	b.mapped = 0;
+	b.total = 0;
+}
+
+Spill_buffer& Spill_buffer::operator = (Spill_buffer&& b) {
+	if (this != &b) {
+		clear();
+		threshold = b.threshold;
+		directory = std::move(b.directory);
+		memory = std::move(b.memory);
+		fd = b.fd;
+		map = b.map;
+		mapped = b.mapped;
+		total = b.total;
+		b.memory.clear();
+		b.fd = -1;
+		b.map = nullptr;
+		b.mapped = 0;
+		b.total = 0;
+	}
+	return *this;
+}
+
+Spill_buffer::~Spill_buffer() {
+	clear();
+}
+
+void Spill_buffer::append(std::shared_ptr<const uchar> data, size_t size) {
+	if (!size)
+		return;
+	if (fd < 0 && total + size <= threshold) {
+		memory.append(std::move(data), size);
+		total += size;
+		return;
+	}
+	if (fd < 0)
+		spill();
+	write(data.get(), size);
+}
+
+void Spill_buffer::append(const uchar* data, size_t size) {
+	if (!size)
+		return;
+	if (fd < 0 && total + size <= threshold) {
+		memory.append(data, size);
+		total += size;
+		return;
+	}
+	if (fd < 0)
+		spill();
+	write(data, size);
+}
+
+void Spill_buffer::clear() {
+	unmap();
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	memory.clear();
+	total = 0;
+}
+
+const uchar* Spill_buffer::data() {
+	if (fd < 0)
+		return memory.data();
+	if (!total)
+		return nullptr;
+	if (mapped != total) {
+		unmap();
+		void* p = mmap(nullptr, total, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			throw std::system_error(errno, std::system_category(), "Spill_buffer: mmap");
+		map = p;
+		mapped = total;
+	}
+	return static_cast<const uchar*>(map);
+}
+
+size_t Spill_buffer::copy(uchar* dest, size_t count, size_t pos) const {
+	if (fd < 0)
+		return memory.copy(dest, count, pos);
+	if (pos >= total)
+		return 0;
+	if (count > total - pos)
+		count = total - pos;
+	size_t copied = 0;
+	while (copied < count) {
+		ssize_t n = pread(fd, dest + copied, count - copied, pos + copied);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::system_category(), "Spill_buffer: pread");
+		}
+		if (!n)
+			break;
+		copied += n;
+	}
+	return copied;
+}
+
+void Spill_buffer::spill() {
+	fd = create_file(directory);
+	// total is rewritten as the bytes go out
+	size_t size = total;
+	total = 0;
+	try {
+		for (auto const& s : memory.slices())
+			write(s.data.get(), s.size);
+	} catch (...) {
+		close(fd);
+		fd = -1;
+		total = size;
+		throw;
+	}
+	memory.clear();
+}
+
+void Spill_buffer::write(const uchar* data, size_t size) {
+	size_t written = 0;
+	while (written < size) {
+		ssize_t n = ::write(fd, data + written, size - written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			int erno = errno;
+			// Drop what got written, so the next append lands where it should
+			if (ftruncate(fd, total) == 0)
+				lseek(fd, total, SEEK_SET);
+			throw std::system_error(erno, std::system_category(), "Spill_buffer: write");
+		}
+		written += n;
+	}
+	total += size;
+}
+
+void Spill_buffer::unmap() {
+	if (map) {
+		munmap(map, mapped);
+		map = nullptr;
+		mapped = 0;
+	}
+}
+
+MOSH_FCGI_END
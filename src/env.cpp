@@ -0,0 +1,234 @@
+//! @file  env.cpp Defines the Env class
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <string>
+
+#include <mosh/fcgi/env.hpp>
+#include <mosh/fcgi/bits/str_ref.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+namespace {
+
+//! Names of the well-known parameters, in the order of Env::Var
+constexpr const char* names[] = {
+	"AUTH_TYPE",
+	"CONTENT_LENGTH",
+	"CONTENT_TYPE",
+	"DOCUMENT_ROOT",
+	"DOCUMENT_URI",
+	"GATEWAY_INTERFACE",
+	"HTTPS",
+	"HTTP_ACCEPT",
+	"HTTP_ACCEPT_ENCODING",
+	"HTTP_ACCEPT_LANGUAGE",
+	"HTTP_AUTHORIZATION",
+	"HTTP_CONNECTION",
+	"HTTP_COOKIE",
+	"HTTP_HOST",
+	"HTTP_IF_MODIFIED_SINCE",
+	"HTTP_IF_NONE_MATCH",
+	"HTTP_REFERER",
+	"HTTP_USER_AGENT",
+	"PATH_INFO",
+	"PATH_TRANSLATED",
+	"QUERY_STRING",
+	"REMOTE_ADDR",
+	"REMOTE_HOST",
+	"REMOTE_PORT",
+	"REMOTE_USER",
+	"REQUEST_METHOD",
+	"REQUEST_SCHEME",
+	"REQUEST_URI",
+	"SCRIPT_FILENAME",
+	"SCRIPT_NAME",
+	"SERVER_ADDR",
+	"SERVER_NAME",
+	"SERVER_PORT",
+	"SERVER_PROTOCOL",
+	"SERVER_SOFTWARE"
+};
+const size_t vars = sizeof(names) / sizeof(names[0]);
+static_assert(vars == MOSH_FCGI::Env::vars, "Env: a Var without a name");
+
+//! Slots of the hash table
+const size_t slots = 128;
+//! Shortest and longest names
+const size_t min_length = 5, max_length = 22;
+
+constexpr size_t length(const char* s) {
+	return *s ? 1 + length(s + 1) : 0;
+}
+
+/*! @brief Hash of a name of min_length to max_length characters
+ *
+ * Found by trying multipliers until the names above came out distinct. The 4th character
+ * and the one before last tell apart names with the same prefix, such as the HTTP_ ones.
+ */
+constexpr size_t hash(const char* s, size_t n) {
+	return (n * 6 + static_cast<unsigned char>(s[3]) * 61 + static_cast<unsigned char>(s[n - 2])) % slots;
+}
+
+constexpr size_t slot_of(size_t v) {
+	return hash(names[v], length(names[v]));
+}
+
+constexpr bool fits(size_t v) {
+	return v == vars || (length(names[v]) >= min_length && length(names[v]) <= max_length && fits(v + 1));
+}
+
+constexpr bool distinct_from(size_t v, size_t w) {
+	return w == vars || (slot_of(v) != slot_of(w) && distinct_from(v, w + 1));
+}
+
+constexpr bool perfect(size_t v) {
+	return v == vars || (distinct_from(v, v + 1) && perfect(v + 1));
+}
+
+static_assert(fits(0), "Env: a name is too short or too long for the hash");
+static_assert(perfect(0), "Env: the hash isn't perfect for the names");
+
+//! Var of each slot of the hash table
+struct Table {
+	Table() {
+		for (auto& e : vars_by_slot)
+			e = MOSH_FCGI::Env::Var::none;
+		for (size_t v = 0; v < vars; ++v)
+			vars_by_slot[slot_of(v)] = static_cast<MOSH_FCGI::Env::Var>(v);
+	}
+	std::array<MOSH_FCGI::Env::Var, slots> vars_by_slot;
+};
+
+Table const& table() {
+	static const Table t;
+	return t;
+}
+
+/*! @brief Decode the length of a name or value
+ * @param[in,out] p Position in the stream; moved past the length
+ * @param[in] end End of the stream
+ * @param[out] n The length
+ * @return false if the stream ends first
+ */
+bool decode_length(const unsigned char*& p, const unsigned char* end, size_t& n) {
+	if (p == end)
+		return false;
+	if (!(*p & 0x80)) {
+		n = *p++;
+		return true;
+	}
+	if (end - p < 4)
+		return false;
+	n = (static_cast<size_t>(p[0] & 0x7f) << 24) | (static_cast<size_t>(p[1]) << 16) | (static_cast<size_t>(p[2]) << 8) | p[3];
+	p += 4;
+	return true;
+}
+
+}
+
+MOSH_FCGI_BEGIN
+
+Env::Var Env::var(Str_ref name) {
+	if (name.size() < min_length || name.size() > max_length)
+		return Var::none;
+	Var v = table().vars_by_slot[hash(name.data(), name.size())];
+	if (v == Var::none || Str_ref(names[static_cast<size_t>(v)]) != name)
+		return Var::none;
+	return v;
+}
+
+Str_ref Env::name(Var v) {
+	return v == Var::none ? Str_ref() : Str_ref(names[static_cast<size_t>(v)]);
+}
+
+Env::Env() {
+	index.fill(0);
+}
+
+Env::const_iterator Env::find(Str_ref name) const {
+	Var v = var(name);
+	if (v != Var::none)
+		return has(v) ? params.begin() + (index[static_cast<size_t>(v)] - 1) : params.end();
+	return std::find_if(params.begin(), params.end(), [name] (value_type const& p) { return p.first == name; });
+}
+
+Str_ref Env::operator [] (Str_ref name) const {
+	const_iterator it = find(name);
+	return it != end() ? it->second : Str_ref();
+}
+
+Str_ref Env::operator [] (Var v) const {
+	return has(v) ? params[index[static_cast<size_t>(v)] - 1].second : Str_ref();
+}
+
+size_t Env::content_length() const {
+	Str_ref s((*this)[Var::content_length]);
+	size_t n = 0;
+	for (char c : s) {
+		if (c < '0' || c > '9')
+			return 0;
+		size_t d = c - '0';
+		// Too big to be a length, let alone one we'd take
+		if (n > (std::numeric_limits<size_t>::max() - d) / 10)
+			return 0;
+		n = n * 10 + d;
+	}
+	return n;
+}
+
+void Env::append(const uchar* data, size_t size) {
+	stream.append(reinterpret_cast<const char*>(data), size);
+}
+
+void Env::parse(std::function<bool(value_type const&)> const& keep) {
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(stream.data());
+	const unsigned char* end = p + stream.size();
+	for (;;) {
+		size_t name_size, value_size;
+		if (!decode_length(p, end, name_size) || !decode_length(p, end, value_size)
+				|| static_cast<size_t>(end - p) < name_size + value_size)
+			break;
+		value_type param(Str_ref(reinterpret_cast<const char*>(p), name_size),
+				Str_ref(reinterpret_cast<const char*>(p) + name_size, value_size));
+		p += name_size + value_size;
+		if (!keep(param))
+			continue;
+		Var v = var(param.first);
+		if (v != Var::none) {
+			// As with a map, the first of a name wins
+			if (has(v))
+				continue;
+			index[static_cast<size_t>(v)] = params.size() + 1;
+		}
+		params.push_back(param);
+	}
+}
+
+void Env::clear() {
+	stream.clear();
+	params.clear();
+	index.fill(0);
+}
+
+MOSH_FCGI_END
@@ -30,6 +30,11 @@
 #include <stdexcept>
 #include <streambuf>
 #include <string>
+#include <system_error>
+extern "C" {
+#include <errno.h>
+#include <unistd.h>
+}
 #include <mosh/fcgi/bits/u.hpp>
 #include <mosh/fcgi/bits/block.hpp>
 #include <mosh/fcgi/protocol/types.hpp>
@@ -45,7 +50,7 @@ MOSH_FCGI_BEGIN
 
 class Fcgistream::Fcgibuf: public std::basic_streambuf<uchar> {
 public:
-	Fcgibuf() : dump_ptr(0), dump_size(0) {
+	Fcgibuf() : dump_ptr(0), dump_size(0), cancellation(nullptr) {
 		setp(buffer, buffer + buff_size);
 	}
 	/*! @brief After construction constructor
@@ -55,11 +60,17 @@ public:
 	 * @param[in] id Complete ID associated with the request
 	 * @param[in] transceiver Transceiver object to use for transmission
 	 * @param[in] type Type of output stream (err or out)
+	 * @param[in] cancellation Token of the request; output is dropped once it's cancelled
 	 */
-	void set(protocol::Full_id id, Transceiver& transceiver, protocol::Record_type type) {
+	void set(protocol::Full_id id, Transceiver& transceiver, protocol::Record_type type, Cancel_token const* cancellation) {
 		this->id = id;
 		this->transceiver = &transceiver;
 		this->type = type;
+		this->cancellation = cancellation;
+	}
+	// Test if the output is to be dropped
+	bool cancelled() const {
+		return cancellation && cancellation->cancelled();
 	}
 		virtual ~Fcgibuf() {
 		try {
@@ -72,6 +83,12 @@ public:
 			dump_size = size;
 			sync();
 		}
+		// Send part of a file without copying it
+		void send_file(int fd, off_t offset, size_t length);
+		// Call f once the output has gone out
+		bool when_drained(std::function<void()> f) {
+			return transceiver->when_drained(id, std::move(f));
+		}
 
 private:
 	typedef typename std::basic_streambuf<uchar>::int_type int_type;
@@ -102,6 +119,8 @@ private:
 	protocol::Full_id id;
 	//! Type of output stream (err or out)
 	protocol::Record_type type;
+	//! Token of the request, if any
+	Cancel_token const* cancellation;
 	//! Size of the internal stream buffer
 	static const size_t buff_size = 8192;
 	//! The buffer
@@ -115,8 +134,12 @@ Fcgistream::Fcgistream() : std::basic_ostream<uchar>(), pbuf(new Fcgibuf) {
 Fcgistream::~Fcgistream() {
 }
 
-void Fcgistream::set(protocol::Full_id id, Transceiver& transceiver, protocol::Record_type type) {
-	pbuf->set(id, transceiver, type);
+void Fcgistream::set(protocol::Full_id id, Transceiver& transceiver, protocol::Record_type type, Cancel_token const* cancellation) {
+	pbuf->set(id, transceiver, type, cancellation);
+}
+
+bool Fcgistream::cancelled() const {
+	return pbuf->cancelled();
 }
 
 void Fcgistream::dump(const uchar* data, size_t size) {
@@ -135,6 +158,15 @@ void Fcgistream::dump(std::string const& str) {
 	pbuf->dump(reinterpret_cast<const uchar*>(str.data()), str.size());
 }
 
+void Fcgistream::send_file(int fd, off_t offset, size_t length) {
+	pbuf->send_file(fd, offset, length);
+}
+
+bool Fcgistream::when_drained(std::function<void()> f) {
+	flush();
+	return pbuf->when_drained(std::move(f));
+}
+
 void Fcgistream::dump(std::basic_istream<char>& stream) {
 	std::array<char, 32768> buffer;
 
@@ -163,6 +195,11 @@ Fcgistream& operator << (Fcgistream& os, u_string const& us) {
 	return os;
 }
 
+Fcgistream& operator << (Fcgistream& os, Str_ref s) {
+	os.rdbuf()->sputn(reinterpret_cast<const unsigned char *>(s.data()), s.size());
+	return os;
+}
+
 Fcgistream& operator << (Fcgistream& os, std::wstring const& ws) {
 	const wchar_t* w_begin = ws.data();
 	const wchar_t* w_end = ws.data() + ws.size();
@@ -204,6 +241,11 @@ int Fcgistream::Fcgibuf::empty_buffer() {
 	using namespace protocol;
 	char_type const* p_stream_pos = this->pbase();
 	while (1) {
+		// Nobody is waiting for the rest any more; the records gone out so far are whole
+		if (cancelled()) {
+			dump_size = 0;
+			break;
+		}
 		size_t count = this->pptr() - p_stream_pos;
 		size_t wanted_size = count * sizeof(char_type) + dump_size;
 		if (!wanted_size)
@@ -213,7 +255,7 @@ int Fcgistream::Fcgibuf::empty_buffer() {
 		if (wanted_size > numeric_limits<uint16_t>::max())
 			wanted_size = numeric_limits<uint16_t>::max();
 
-		Block data_block(transceiver->request_write(wanted_size));
+		Block data_block(transceiver->request_write(wanted_size, id));
 		data_block.size = (data_block.size / chunk_size) * chunk_size;
 		locale loc = this->getloc();
 		uchar* to_next = data_block.data + sizeof(Header);
@@ -236,12 +278,44 @@ int Fcgistream::Fcgibuf::empty_buffer() {
 		header.request_id() = id.fcgi_id;
 		header.content_length() = content_length;
 		header.padding_length() = content_remainder ? (chunk_size - content_remainder) : content_remainder;
-		transceiver->secure_write(sizeof(Header) + content_length + header.padding_length(), id, false);
+		transceiver->secure_write(data_block, sizeof(Header) + content_length + header.padding_length(), id, false);
+		transceiver->throttle(id, cancellation);
 	}
 	pbump(-(this->pptr() - this->pbase()));
 	return 0;
 }
 
+void Fcgistream::Fcgibuf::send_file(int fd, off_t offset, size_t length) {
+	using namespace std;
+	using namespace protocol;
+	// Whatever has been written to the stream goes first
+	empty_buffer();
+	if (!length || cancelled())
+		return;
+
+	int file = dup(fd);
+	if (file < 0)
+		throw system_error(errno, system_category(), "Fcgistream::send_file(): dup");
+	shared_ptr<Transceiver::File> pfile(make_shared<Transceiver::File>(file));
+
+	const size_t max_content = (numeric_limits<uint16_t>::max() / chunk_size) * chunk_size;
+	while (length) {
+		uint16_t content_length = min(length, max_content);
+		uint8_t padding = (chunk_size - content_length % chunk_size) % chunk_size;
+		Block block(transceiver->request_write(sizeof(Header), id));
+		Header& header = *reinterpret_cast<Header*>(block.data);
+		header.version() = version;
+		header.type() = type;
+		header.request_id() = id.fcgi_id;
+		header.content_length() = content_length;
+		header.padding_length() = padding;
+		// Header, content and padding go in as one, so records of other requests can't split them
+		transceiver->secure_file(block, sizeof(Header), pfile, offset, content_length, padding, id);
+		offset += content_length;
+		length -= content_length;
+	}
+}
+
 std::streamsize Fcgistream::Fcgibuf::xsputn(const uchar* s, std::streamsize n)
 {
 	std::streamsize remainder = n;
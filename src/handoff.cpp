@@ -0,0 +1,197 @@
+//! @file  handoff.cpp Passing sockets to another process
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+#include <vector>
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+#include <mosh/fcgi/handoff.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+namespace {
+
+//! File descriptors sent per message, below the kernel's limit (253 on Linux)
+const size_t batch = 240;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+//! Fill in the address of a Unix socket
+socklen_t unix_address(const char* path, sockaddr_un& addr) {
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(addr.sun_path))
+		throw std::system_error(ENAMETOOLONG, std::system_category(), "handoff: socket path");
+	std::strcpy(addr.sun_path, path);
+	return sizeof(addr);
+}
+
+//! Close file descriptors received before a failure
+void close_all(std::vector<int> const& fds) {
+	for (int fd : fds)
+		close(fd);
+}
+
+}
+
+MOSH_FCGI_BEGIN
+
+namespace handoff {
+
+int listen(const char* path) {
+	sockaddr_un addr;
+	socklen_t addrlen = unix_address(path, addr);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category(), "handoff: socket");
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	unlink(path);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), addrlen) < 0 || ::listen(fd, 1) < 0) {
+		int erno = errno;
+		close(fd);
+		throw std::system_error(erno, std::system_category(), "handoff: listen");
+	}
+	return fd;
+}
+
+std::vector<int> take_over(const char* path) {
+	sockaddr_un addr;
+	socklen_t addrlen = unix_address(path, addr);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		throw std::system_error(errno, std::system_category(), "handoff: socket");
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	if (connect(sock, reinterpret_cast<sockaddr*>(&addr), addrlen) < 0) {
+		int erno = errno;
+		close(sock);
+		// Nobody to take over from; a cold start
+		if (erno == ENOENT || erno == ECONNREFUSED)
+			return std::vector<int>();
+		throw std::system_error(erno, std::system_category(), "handoff: connect");
+	}
+	try {
+		std::vector<int> fds(receive(sock));
+		close(sock);
+		return fds;
+	} catch (...) {
+		close(sock);
+		throw;
+	}
+}
+
+void send(int sock, std::vector<int> const& fds) {
+	size_t done = 0;
+	do {
+		size_t n = std::min(batch, fds.size() - done);
+		// The byte tells whether more messages follow
+		char more = done + n < fds.size();
+		iovec iov;
+		iov.iov_base = &more;
+		iov.iov_len = 1;
+		std::vector<char> control(CMSG_SPACE(sizeof(int) * batch));
+		msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (n) {
+			msg.msg_control = control.data();
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+			std::memcpy(CMSG_DATA(cmsg), fds.data() + done, sizeof(int) * n);
+		}
+		ssize_t sent;
+		do
+			sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		while (sent < 0 && errno == EINTR);
+		if (sent < 0)
+			throw std::system_error(errno, std::system_category(), "handoff: sendmsg");
+		done += n;
+	} while (done < fds.size());
+}
+
+std::vector<int> receive(int sock) {
+	std::vector<int> fds;
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * batch));
+	for (;;) {
+		char more;
+		iovec iov;
+		iov.iov_base = &more;
+		iov.iov_len = 1;
+		msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+		flags |= MSG_CMSG_CLOEXEC;
+#endif
+		ssize_t got;
+		do
+			got = recvmsg(sock, &msg, flags);
+		while (got < 0 && errno == EINTR);
+		if (got < 0) {
+			int erno = errno;
+			close_all(fds);
+			throw std::system_error(erno, std::system_category(), "handoff: recvmsg");
+		}
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < n; ++i) {
+				int fd;
+				std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				fds.push_back(fd);
+			}
+		}
+		if (got == 0) {
+			// Closed without sending anything: the other side didn't hand off
+			if (fds.empty())
+				return fds;
+			close_all(fds);
+			throw std::system_error(EPROTO, std::system_category(), "handoff: cut short");
+		}
+		if (msg.msg_flags & MSG_CTRUNC) {
+			close_all(fds);
+			throw std::system_error(EPROTO, std::system_category(), "handoff: descriptors truncated");
+		}
+		if (!more)
+			return fds;
+	}
+}
+
+}
+
+MOSH_FCGI_END
@@ -1,14 +1,27 @@
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <utility>
+#include <vector>
 
+#include <unistd.h>
+
+#include <mosh/fcgi/handoff.hpp>
 #include <mosh/fcgi/manager.hpp>
 #include <mosh/fcgi/protocol/funcs.hpp>
 #include <mosh/fcgi/protocol/types.hpp>
 #include <mosh/fcgi/protocol/vars.hpp>
 #include <mosh/fcgi/protocol/begin_request.hpp>
+#include <mosh/fcgi/protocol/end_request.hpp>
 #include <mosh/fcgi/protocol/full_id.hpp> 
 #include <mosh/fcgi/protocol/message.hpp>
 #include <mosh/fcgi/protocol/unknown_type.hpp>
@@ -22,20 +35,68 @@
 
 namespace {
 
-MOSH_FCGI::Manager* instance;
+static_assert(ATOMIC_POINTER_LOCK_FREE == 2, "Manager: the signal handler needs lock-free pointers");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Manager: the signal handler needs lock-free integers");
+
+/*! @brief Every Manager in the process, for signals to be routed to
+ *
+ * A list of blocks of slots. Slots are claimed and released with atomic operations
+ * only, and blocks are added as needed but never freed, so the signal handler can
+ * walk them safely at any time. Blocks have no constructor, so they are zero-initialised
+ * (with @c new @c Registry() for those added later): the first one is ready before any
+ * dynamic initialisation that might make a Manager.
+ */
+struct Registry {
+	std::array<std::atomic<MOSH_FCGI::Manager*>, 64> slots;
+	std::atomic<Registry*> next;
+};
+
+//! First block of the registry
+Registry instances;
 
-/*! @brief A list of recognized management parameters.
+/*! @brief Number of signal handlers walking the registry
  *
- * Used by process_gv().
+ * A handler may have read a Manager from its slot just before the slot was cleared, so
+ * a Manager coming apart waits for this to drop to 0 after leaving the registry.
  */
-const std::map<std::string, std::string> management_params = {
-		{ "FCGI_MAX_CONNS", "10" }, 
-		{ "FCGI_MAX_REQS",  "50" },
-		{ "FCGI_MPXS_CONNS", "1" }
-	};
+std::atomic<int> handlers_running;
+
+//! Put a Manager in the registry
+void add_instance(MOSH_FCGI::Manager* manager) {
+	for (Registry* r = &instances;;) {
+		for (auto& slot : r->slots) {
+			MOSH_FCGI::Manager* empty = nullptr;
+			if (slot.compare_exchange_strong(empty, manager))
+				return;
+		}
+		Registry* next = r->next.load();
+		if (next == nullptr) {
+			std::unique_ptr<Registry> block(new Registry());
+			if (r->next.compare_exchange_strong(next, block.get()))
+				next = block.release();
+		}
+		r = next;
+	}
+}
+
+//! Take a Manager out of the registry
+void remove_instance(MOSH_FCGI::Manager* manager) {
+	for (Registry* r = &instances; r != nullptr; r = r->next.load()) {
+		for (auto& slot : r->slots) {
+			MOSH_FCGI::Manager* self = manager;
+			if (slot.compare_exchange_strong(self, nullptr))
+				return;
+		}
+	}
+}
 
 //! Process a GET_VALUES record and generate an appropriate output
-SRC::u_string process_gv(const SRC::uchar* data, size_t data_len) {
+/*!
+ * @param[in] data Body of the record
+ * @param[in] data_len Size of data
+ * @param[in] management_params Recognized management parameters and their values
+ */
+SRC::u_string process_gv(const SRC::uchar* data, size_t data_len, std::map<std::string, std::string> const& management_params) {
 	// enqueue params
 	std::queue<std::string> queue;
 	while (data_len > 0) {
@@ -58,22 +119,42 @@ SRC::u_string process_gv(const SRC::uchar* data, size_t data_len) {
 	return res;
 }
 
+//! Test if a message is a BEGIN_REQUEST record
+bool begins_request(MOSH_FCGI::protocol::Message const& message) {
+	using namespace MOSH_FCGI;
+	using namespace MOSH_FCGI::protocol;
+	if (message.type)
+		return false;
+	aligned<8, Header> _header(static_cast<const void *>(message.data.get()));
+	Header& header = _header;
+	return header.type() == Record_type::begin_request;
+}
+
 //! Global signal handler
 void signal_handler(int signo) {
-	if (instance == nullptr)
-		return;
-	switch (signo) {
-	case SIGUSR1:
-		instance->terminate();
-		break;
-	case SIGTERM:
-		instance->stop();
-		break;
+	handlers_running.fetch_add(1);
+	for (Registry* r = &instances; r != nullptr; r = r->next.load()) {
+		for (auto& slot : r->slots) {
+			// Cleared as a Manager starts coming apart, so a Manager found here is whole
+			MOSH_FCGI::Manager* instance = slot.load();
+			if (instance == nullptr)
+				continue;
+			switch (signo) {
+			case SIGUSR1:
+				instance->terminate();
+				break;
+			case SIGTERM:
+				instance->stop();
+				break;
+			}
+		}
 	}
+	handlers_running.fetch_sub(1);
 }
 	
 void setup_signals() {
 	struct sigaction _sa;
+	std::memset(&_sa, 0, sizeof(_sa));
 	_sa.sa_handler = signal_handler;
 
 	sigaction(SIGPIPE, &_sa, NULL); // No-op
@@ -86,21 +167,52 @@ void setup_signals() {
 
 MOSH_FCGI_BEGIN
 
-Manager::Manager(int fd, std::function<Request_base*()> new_req)
+Manager::Manager(int fd, std::function<Request_base*()> new_req, Transceiver::Options const& options, Limits const& limits_,
+		size_t workers_, size_t pool_size_)
 	: transceiver(fd, [&] (protocol::Full_id a1, protocol::Message a2) {
 					push(a1, a2);
-				}),
-	new_request(new_req), asleep(false), do_stop(false), do_terminate(false)
+				}, options, limits_.max_conns,
+				[this] (int fd) { return requests.any_of(fd, [] (Request_base const&) { return true; }); }),
+	pool(pool_size_ ? std::make_shared<Pool>(pool_size_) : nullptr), new_request(new_req), limits(limits_), workers_quit(false), asleep(false), do_stop(false), do_terminate(false),
+	handoff_sock(-1), handoff_connections(false)
 {
-	if (instance != nullptr)
-		throw std::runtime_error("Detected concurrent instances of Manager per process");
+	// Limits of 0 mean there is no limit, which is best told by not answering at all
+	if (limits.max_conns)
+		management_params["FCGI_MAX_CONNS"] = std::to_string(limits.max_conns);
+	if (limits.max_reqs)
+		management_params["FCGI_MAX_REQS"] = std::to_string(limits.max_reqs);
+	management_params["FCGI_MPXS_CONNS"] = limits.mpxs_conns ? "1" : "0";
 
+	try {
+		for (size_t i = 0; i < workers_; ++i)
+			workers.emplace_back(&Manager::work, this);
+	} catch (...) {
+		join_workers();
+		throw;
+	}
+
+	try {
+		add_instance(this);
+	} catch (...) {
+		join_workers();
+		throw;
+	}
 	setup_signals();
-	instance = this;
 }
 
 Manager::~Manager() {
-	instance = nullptr;
+	// No more signals for us before we start coming apart, not even from a handler that
+	// found us just before
+	remove_instance(this);
+	while (handlers_running.load())
+		std::this_thread::yield();
+	join_workers();
+	// Requests let go of from now on, the ones still queued included, are just deleted
+	if (pool) {
+		std::lock_guard<std::mutex> lock(pool->idle);
+		pool->closed = true;
+		pool->idle.clear();
+	}
 }
 
 void Manager::push(protocol::Full_id id, protocol::Message message) {
@@ -108,138 +220,294 @@ void Manager::push(protocol::Full_id id, protocol::Message message) {
 	using namespace protocol;
 
 	if (id.fcgi_id) {
-		std::lock_guard<Rw_lock> read_lock(requests);
-		auto it = requests.find(id);
-		if (it != requests.end()) {
-			lock_guard<mutex> mes_lock(it->second->messages);
-			it->second->messages.push(message);
-			lock_guard<mutex> tasks_guard(tasks);
-			tasks.push(id);
+		std::shared_ptr<Request_base> request(requests.find(id));
+		// A worker may still be winding up a request the other side already got the end of
+		if (request && request->completed && begins_request(message))
+			request.reset();
+		if (request) {
+			Lane l = lane(*request, message);
+			request->messages.push(message);
+			// Whoever takes pending from 0 schedules the request; the others' messages go in the same batch
+			if (request->pending.fetch_add(1, memory_order_acq_rel) != 0) {
+				// Without workers, an aborted request may jump the queue it's already waiting in
+				if (!workers.empty() || l != Lane::urgent)
+					return;
+				tasks.push(Task(request, l));
+			} else if (!workers.empty()) {
+				{
+					lock_guard<mutex> run_lock(runnable);
+					runnable.push(request, l, id.fd);
+				}
+				work_ready.notify_one();
+				return;
+			} else
+				tasks.push(Task(request, l));
 		} else if (!message.type) {
 			aligned<8, Header> _header(static_cast<const void *>(message.data.get()));
 			Header& header = _header;
 			if (header.type() == Record_type::begin_request) {
 				aligned<8, Begin_request> _body(static_cast<const void *>(message.data.get() + sizeof(Header)));
 				Begin_request& body = _body;
-				requests.upgrade_lock();
-				std::shared_ptr<Request_base>& request = requests[id];
-				request.reset(new_request());
+				if (limits.max_reqs && requests.size() >= limits.max_reqs) {
+					refuse(id, Protocol_status::overloaded, !body.keep_conn());
+					return;
+				}
+				if (!limits.mpxs_conns && requests.any_of(id.fd, [] (Request_base const& r) { return !r.completed; })) {
+					refuse(id, Protocol_status::cant_mpx_conn, !body.keep_conn());
+					return;
+				}
+				request = make_request();
 				request->set(id, transceiver, body.role(), !body.keep_conn(),
-						[&] (protocol::Message a1) {
+						[this, id] (protocol::Message a1) {
 							this->push(id, a1);
 						}
 				);
+				requests.insert(id, request);
 			} else {
 				return;
 			}
 		}
-	} else {
-		messages.push(message);
-		tasks.push(id);
-	}
+	} else
+		tasks.push(Task(id, message));
 
-	lock_guard<mutex> sleep_guard(asleep);
-	if (asleep)
+	atomic_thread_fence(memory_order_seq_cst);
+	if (asleep.load(memory_order_relaxed))
 		transceiver.wake();
 }
 
 void Manager::handler() {
 	thread_id = pthread_self();
 	for (;;) {
-		{
-			std::lock_guard<std::mutex> stop_guard(do_stop);
-			if (do_stop) {
-				do_stop = false;
-				return;
-			}
+		if (do_stop.load(std::memory_order_acquire)) {
+			do_stop.store(false, std::memory_order_relaxed);
+			return;
 		}
 
+		int handoff = handoff_sock.exchange(-1, std::memory_order_acq_rel);
+		if (handoff >= 0)
+			do_hand_off(handoff, handoff_connections.load(std::memory_order_relaxed));
+
 		bool sleep = transceiver.handler();
 
-		{
-			std::lock_guard<std::mutex> terminate_guard(do_terminate);
-			if (do_terminate) {
-				std::lock_guard<Rw_lock> req_lock(requests);
-				bool req_empty = requests.empty();
-				if (req_empty && sleep) {
-					do_terminate = false;
-					return;
-				}
+		if (do_terminate.load(std::memory_order_acquire)) {
+			if (requests.empty() && sleep && transceiver.empty()) {
+				do_terminate.store(false, std::memory_order_relaxed);
+				return;
 			}
 		}
-		
-		tasks.lock();
-		asleep.lock();
-
-		if (tasks.empty()) {
-			tasks.unlock();
-			asleep = true;
-			asleep.unlock();
-			if (sleep)
+
+		Task task;
+		while (tasks.pop(task)) {
+			int fd = task.id.fd;
+			Lane l = task.lane;
+			scheduled.push(std::move(task), l, fd);
+		}
+		if (!scheduled.pop(task)) {
+			asleep.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			// Whatever is pushed from here on wakes us up
+			if (sleep && tasks.empty())
 				transceiver.sleep();
-			asleep.lock();
-			asleep = false;
-			asleep.unlock();
+			asleep.store(false, std::memory_order_relaxed);
 			continue;
 		}
 
-		asleep.unlock();
-
-		protocol::Full_id id = tasks.front();
-		tasks.pop();
-		tasks.unlock();
-		if (id.fcgi_id == 0)
-			local_handler(id);
+		if (task.id.fcgi_id == 0)
+			local_handler(task.id, task.message);
 		else {
-			std::lock_guard<Rw_lock> read_lock(requests);
-			auto it = requests.find(id);
-			if (it != requests.end() && it->second->handler()) {
-				requests.upgrade_lock();
-				requests.erase(it);
-			}
+			std::shared_ptr<Request_base> request(std::move(task.request));
+			// The turn is left over if the request jumped the queue and has been handled since
+			if (request->pending.load(std::memory_order_acquire) && requests.find(task.id) == request)
+				run(request);
+		}
+	}
+}
+
+
+std::shared_ptr<Request_base> Manager::make_request() {
+	if (!pool)
+		return std::shared_ptr<Request_base>(new_request());
+	std::unique_ptr<Request_base> request;
+	{
+		std::lock_guard<std::mutex> lock(pool->idle);
+		if (!pool->idle.empty()) {
+			request = std::move(pool->idle.back());
+			pool->idle.pop_back();
+		}
+	}
+	if (!request)
+		request.reset(new_request());
+	std::shared_ptr<Pool> p(pool);
+	return std::shared_ptr<Request_base>(request.release(), [p] (Request_base* r) { recycle(p, r); });
+}
+
+void Manager::recycle(std::shared_ptr<Pool> const& pool, Request_base* request) {
+	std::unique_ptr<Request_base> r(request);
+	try {
+		{
+			// reset() flushes to the Manager's transceiver, gone once the pool is closed
+			std::lock_guard<std::mutex> lock(pool->idle);
+			if (pool->closed)
+				return;
+		}
+		r->reset();
+		std::lock_guard<std::mutex> lock(pool->idle);
+		if (!pool->closed && pool->idle.size() < pool->size)
+			pool->idle.push_back(std::move(r));
+	} catch (...) {
+		// A request that can't be reset is deleted instead
+	}
+}
+
+void Manager::work() {
+	for (;;) {
+		std::shared_ptr<Request_base> request;
+		{
+			std::unique_lock<std::mutex> lock(runnable);
+			work_ready.wait(lock, [this] { return workers_quit || !runnable.empty(); });
+			if (runnable.empty())
+				return;
+			runnable.pop(request);
+		}
+		run(request);
+	}
+}
+
+void Manager::run(std::shared_ptr<Request_base> const& request) {
+	for (;;) {
+		if (request->handler()) {
+			requests.erase(request->id, request);
+			// The last request on a connection hung up on closes it
+			transceiver.request_over(request->id.fd);
+			// A terminating handler() may be waiting for the last request to go
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (asleep.load(std::memory_order_relaxed))
+				transceiver.wake();
+			return;
 		}
+		// Anything pushed meanwhile is ours to handle, as push() won't hand the request out again
+		if (request->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			return;
 	}
 }
 
+void Manager::join_workers() {
+	{
+		std::lock_guard<std::mutex> lock(runnable);
+		workers_quit = true;
+	}
+	work_ready.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+	workers.clear();
+}
 
-void Manager::local_handler(protocol::Full_id id) {
+void Manager::local_handler(protocol::Full_id id, protocol::Message const& msg) {
 	using namespace protocol;
 	using namespace std;
-	Message msg(messages.front());
-	messages.pop();
 	if (msg.type)
 		return;
 	aligned<8, Header> _header(static_cast<const void *>(msg.data.get()));
 	Header& header = _header;
 	switch (header.type()) {
 	case Record_type::get_values: {
-		u_string res = process_gv(msg.data.get() + sizeof(Header), header.content_length());
-		Block buffer(transceiver.request_write(res.size() + 16));
+		u_string res = process_gv(msg.data.get() + sizeof(Header), header.content_length(), management_params);
+		Block buffer(transceiver.request_write(res.size() + 16, id));
 		memcpy(buffer.data + 8, res.data(), res.size());
 		Header h(version, Record_type::get_values_result, 0, res.size(), (8 - (res.size() % 8)) % 8);
 		memcpy(buffer.data, &h, sizeof(Header));
-		transceiver.secure_write(sizeof h + h.content_length() + h.padding_length(), id, false);
+		transceiver.secure_write(buffer, sizeof h + h.content_length() + h.padding_length(), id, false);
 	}; break;
 	default: {
-		Block buffer(transceiver.request_write(sizeof(Header) + sizeof(Unknown_type)));
+		Block buffer(transceiver.request_write(sizeof(Header) + sizeof(Unknown_type), id));
 		Header send_header(version, Record_type::unknown_type, 0, sizeof(Unknown_type), 0);
 		Unknown_type send_body;
 		send_body.type() = header.type();
 		memcpy(buffer.data, &send_header, sizeof(Header));
 		memcpy(buffer.data + sizeof(Header), &send_body, sizeof(Unknown_type));
-		transceiver.secure_write(sizeof(Header) + sizeof(Unknown_type), id, false);
+		transceiver.secure_write(buffer, sizeof(Header) + sizeof(Unknown_type), id, false);
 	}; break;
 	}
 }
 
+Lane Manager::lane(Request_base& request, protocol::Message const& message) {
+	using namespace protocol;
+	if (message.type == 0) {
+		aligned<8, Header> _header(static_cast<const void *>(message.data.get()));
+		Header& header = _header;
+		switch (header.type()) {
+		case Record_type::abort_request:
+			request.cancellation.cancel();
+			break;
+		case Record_type::in:
+			// FCGI_DATA follows stdin for a filter
+			if (!header.content_length() && request.role != Role::filter)
+				request.input_done.store(true, std::memory_order_relaxed);
+			break;
+		case Record_type::data:
+			if (!header.content_length())
+				request.input_done.store(true, std::memory_order_relaxed);
+			break;
+		default:;
+		}
+	} else
+		// Anything else is passed by the application to a request well under way
+		request.input_done.store(true, std::memory_order_relaxed);
+	if (request.cancellation.cancelled())
+		return Lane::urgent;
+	return request.input_done.load(std::memory_order_relaxed) ? Lane::ready : Lane::bulk;
+}
+
+void Manager::refuse(protocol::Full_id id, protocol::Protocol_status status, bool kill) {
+	using namespace protocol;
+	Header header(version, Record_type::end_request, id.fcgi_id, sizeof(End_request), 0);
+	End_request body(0, status);
+	Block buffer(transceiver.request_write(sizeof(Header) + sizeof(End_request), id));
+	memcpy(buffer.data, &header, sizeof(Header));
+	memcpy(buffer.data + sizeof(Header), &body, sizeof(End_request));
+	transceiver.secure_write(buffer, sizeof(Header) + sizeof(End_request), id, kill);
+}
+
 void Manager::terminate() {
-	std::lock_guard<std::mutex> lock(do_terminate);
-	do_terminate = true;
+	do_terminate.store(true, std::memory_order_release);
+	transceiver.wake();
+}
+
+void Manager::hand_off(int sock, bool connections) {
+	handoff_connections.store(connections, std::memory_order_relaxed);
+	int old = handoff_sock.exchange(sock, std::memory_order_acq_rel);
+	// Only the latest hand-off is carried out
+	if (old >= 0)
+		close(old);
+	transceiver.wake();
+}
+
+void Manager::do_hand_off(int sock, bool connections) {
+	std::vector<int> fds(1, transceiver.listener());
+	if (connections)
+		for (int fd : transceiver.idle_connections())
+			// A request with nothing buffered for it either way is still in flight
+			if (!requests.any_of(fd, [] (Request_base const&) { return true; }))
+				fds.push_back(fd);
+	try {
+		handoff::send(sock, fds);
+	} catch (std::system_error const&) {
+		// Whoever was taking over is gone; carry on as before
+		close(sock);
+		return;
+	}
+	close(sock);
+	transceiver.stop_accepting();
+	for (size_t i = 1; i < fds.size(); ++i) {
+		transceiver.release(fds[i]);
+		close(fds[i]);
+	}
+	do_terminate.store(true, std::memory_order_release);
 }
 
 void Manager::stop() {
-	std::lock_guard<std::mutex> lock(do_stop);
-	do_stop = true;
+	do_stop.store(true, std::memory_order_release);
+	transceiver.wake();
 }
 
 MOSH_FCGI_END
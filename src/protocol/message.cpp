@@ -19,15 +19,16 @@
 ****************************************************************************/
 
 #include <mosh/fcgi/protocol/message.hpp>
+#include <mosh/fcgi/bits/slab_pool.hpp>
 #include <mosh/fcgi/bits/namespace.hpp>
-#include <src/array_deleter.hpp>
-#include <src/namespace.hpp>
 
 MOSH_FCGI_BEGIN
 
 namespace protocol {
 
-Message::Message() : data(0, SRC::Array_deleter<uchar>()) { }
+Message::Message() : type(0), size(0) { }
+
+Message::Message(unsigned type, size_t size) : type(type), size(size), data(Slab_pool::instance().allocate(size)) { }
 
 }
 
@@ -35,6 +35,7 @@
 #include <mosh/fcgi/bits/aligned.hpp>
 #include <mosh/fcgi/bits/block.hpp>
 #include <mosh/fcgi/transceiver.hpp>
+#include <mosh/fcgi/env.hpp>
 #include <mosh/fcgi/fcgistream.hpp>
 #include <mosh/fcgi/http/session.hpp>
 #include <mosh/fcgi/bits/locked.hpp>
@@ -49,7 +50,7 @@ namespace {
 MOSH_FCGI_BEGIN
 
 Request_base::Request_base()
-: state(protocol::Record_type::params) {
+: pending(0), completed(false), input_done(false), state(protocol::Record_type::params), streaming(false) {
 	out.exceptions(std::ios_base::badbit | std::ios_base::failbit | std::ios_base::eofbit);
 	err.exceptions(std::ios_base::badbit | std::ios_base::failbit | std::ios_base::eofbit);
 }
@@ -62,10 +63,16 @@ bool Request_base::handler() {
 	using namespace std;
 
 	try {
-		{
-			std::lock_guard<std::mutex> lock(messages);
-			message = messages.front();
-			messages.pop();
+		// The task may be left over from an earlier request with the same id
+		if (!messages.pop(message))
+			return false;
+		// Whatever the other side no longer wants isn't worth computing, but it still gets
+		// its END_REQUEST, and a connection it was to close is closed
+		if (cancellation.cancelled()) {
+			while (messages.pop(message))
+				;
+			complete(0);
+			return true;
 		}
 		if (message.type != 0) {
 			if (response()) {
@@ -78,25 +85,25 @@ bool Request_base::handler() {
 		aligned<sizeof(Header), Header> _header(static_cast<const void*>(message.data.get()));
 		Header& header = _header;
 		const uchar* body = message.data.get() + sizeof(Header);
+		// Whether response() is to be called for this record
+		bool respond = false;
 		switch (header.type()) {
 		case Record_type::params: {
 			if (state != Record_type::params)
 				throw exceptions::Record_out_of_order(id, state, Record_type::params);
 			if (header.content_length() == 0) {
-				fill_params(true);
+				fill_params();
 				if (role == Role::authorizer) {
 					state = Record_type::out;
-					if (response()) {
-						complete(0);
-						return true;
-					}
+					respond = true;
 					break;
 				}
 				state = Record_type::in;
+				streaming = streams_input();
+				respond = streaming;
 				break;
 			}
-			pbuf.append(body, body + header.content_length());
-			fill_params(false);
+			envs.append(body, header.content_length());
 		} break;
 		case Record_type::in: {
 			if (state != Record_type::in)
@@ -105,16 +112,15 @@ bool Request_base::handler() {
 				in_handler(nullptr, 0);
 				if (role == Role::filter) {
 					state = Record_type::data;
+					respond = streaming;
 					break;
 				}
 				state = Record_type::out;
-				if (response()) {
-					complete(0);
-					return true;
-				}
+				respond = true;
 				break;
 			}
 			in_handler(body, header.content_length());
+			respond = streaming;
 		} break;
 		case Record_type::data: {
 			if (state != Record_type::data)
@@ -122,19 +128,24 @@ bool Request_base::handler() {
 			if (header.content_length() == 0) {
 				data_handler(nullptr, 0);
 				state = Record_type::out;
-				if (response()) {
-					complete(0);
-					return true;
-				}
+				respond = true;
+				break;
 			}
 			data_handler(body, header.content_length());
+			respond = streaming;
 		} break;
 		case Record_type::abort_request:
-				return true;
+			complete(0);
+			return true;
 		default:;
 		}
+		if (respond && response()) {
+			complete(0);
+			return true;
+		}
 	} catch (std::exception& e) {
-		err << e.what() << std::endl;
+		// Not std::endl, which needs a ctype facet basic_ostream<uchar> has none of
+		err << e.what() << "\n";
 		complete(1);
 		return true;
 	}
@@ -145,16 +156,17 @@ void Request_base::complete(int app_status) {
 	using namespace protocol;
 	out.flush();
 	err.flush();
+	completed = true;
 
 	Header hdr(version, Record_type::end_request, id.fcgi_id, sizeof(End_request), 0);
 	End_request ereq(app_status, Protocol_status::request_complete);
 
-	Block buffer(transceiver->request_write(sizeof(Header) + sizeof(End_request)));
+	Block buffer(transceiver->request_write(sizeof(Header) + sizeof(End_request), id));
 
 	memcpy(buffer.data, &hdr, sizeof(Header));
 	memcpy(buffer.data + sizeof(Header), &ereq, sizeof(End_request));
 
-	transceiver->secure_write(sizeof(Header) + sizeof(End_request), id, kill_con);
+	transceiver->secure_write(buffer, sizeof(Header) + sizeof(End_request), id, kill_con);
 }
 
 void Request_base::set(protocol::Full_id id, Transceiver& transceiver, protocol::Role role, bool kill_con,
@@ -165,23 +177,37 @@ void Request_base::set(protocol::Full_id id, Transceiver& transceiver, protocol:
 	this->role = role;
 	this->callback = callback;
 
-	err.set(id, transceiver, protocol::Record_type::err);
-	out.set(id, transceiver, protocol::Record_type::out);
+	err.set(id, transceiver, protocol::Record_type::err, &cancellation);
+	out.set(id, transceiver, protocol::Record_type::out, &cancellation);
+	// A worker held up writing to a slow connection gives up as soon as the request is aborted
+	Transceiver* t = &transceiver;
+	cancellation.subscribe([t] { t->cancelled_throttle(); });
 }
 
-void Request_base::fill_params(bool term) {
-	while (pbuf.size()) {
-		std::pair<std::string, std::string> params;
-		if (!term) {
-			ssize_t to_erase = protocol::process_param_record(pbuf.data(), pbuf.size(), params);
-			if (to_erase == -1)
-				return;
-			pbuf.erase(0, to_erase);
-		}
-		if (params_handler(params) && !term)
-			envs.insert(params);
+void Request_base::fill_params() {
+	envs.parse([this] (Env::value_type const& param) { return params_handler(param); });
+}
 
-	}
+void Request_base::reset() {
+	// Anything left in the streams goes out, as it would upon destruction
+	try {
+		out.flush();
+		err.flush();
+	} catch (...) { }
+	out.clear();
+	err.clear();
+	protocol::Message left;
+	while (messages.pop(left))
+		;
+	message = protocol::Message();
+	callback = nullptr;
+	envs.clear();
+	pending.store(0, std::memory_order_relaxed);
+	completed.store(false, std::memory_order_relaxed);
+	cancellation.reset();
+	input_done.store(false, std::memory_order_relaxed);
+	state = protocol::Record_type::params;
+	streaming = false;
 }
 
 u_string Request_base::dump() const {
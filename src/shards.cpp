@@ -0,0 +1,134 @@
+//! @file shards.cpp Defines member functions for Shards
+/***************************************************************************
+* Copyright (C) 2012 m0shbear                                              *
+*                                                                          *
+* This file is part of mosh-fcgi.                                          *
+*                                                                          *
+* mosh-fcgi is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* mosh-fcgi is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with mosh-fcgi.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+extern "C" {
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include <mosh/fcgi/manager.hpp>
+#include <mosh/fcgi/shards.hpp>
+#include <mosh/fcgi/bits/namespace.hpp>
+
+MOSH_FCGI_BEGIN
+
+Shards::Shards(int fd, std::function<Request_base*()> new_req, Options const& options)
+	: pin_threads(options.pin)
+{
+	size_t n = count(options);
+	for (size_t i = 0; i < n; ++i)
+		managers.emplace_back(new Manager(fd, new_req, options.transceiver, options.limits, options.workers, options.pool_size));
+}
+
+Shards::Shards(sockaddr const* addr, socklen_t addrlen, std::function<Request_base*()> new_req,
+		Options const& options)
+	: pin_threads(options.pin)
+{
+	size_t n = count(options);
+	try {
+		for (size_t i = 0; i < n; ++i) {
+			sockets.push_back(listen_reuseport(addr, addrlen, options.backlog));
+			managers.emplace_back(new Manager(sockets.back(), new_req, options.transceiver, options.limits, options.workers, options.pool_size));
+		}
+	} catch (...) {
+		managers.clear();
+		for (int fd : sockets)
+			close(fd);
+		throw;
+	}
+}
+
+Shards::~Shards() {
+	managers.clear();
+	for (int fd : sockets)
+		close(fd);
+}
+
+void Shards::handler() {
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < managers.size(); ++i) {
+		Manager* manager = managers[i].get();
+		bool pin_thread = pin_threads;
+		threads.emplace_back([manager, pin_thread, i] () {
+			if (pin_thread)
+				pin(i);
+			manager->handler();
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+}
+
+void Shards::stop() {
+	for (auto& manager : managers)
+		manager->stop();
+}
+
+void Shards::terminate() {
+	for (auto& manager : managers)
+		manager->terminate();
+}
+
+size_t Shards::count(Options const& options) {
+	if (options.count)
+		return options.count;
+	size_t n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
+
+int Shards::listen_reuseport(sockaddr const* addr, socklen_t addrlen, int backlog) {
+	int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category(), "Shards: socket");
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+			|| setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0
+			|| bind(fd, addr, addrlen) < 0
+			|| listen(fd, backlog) < 0) {
+		int erno = errno;
+		close(fd);
+		throw std::system_error(erno, std::system_category(), "Shards: listen");
+	}
+	return fd;
+}
+
+void Shards::pin(size_t core) {
+#ifdef __linux__
+	size_t cores = std::thread::hardware_concurrency();
+	if (!cores)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % cores, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)core;
+#endif
+}
+
+MOSH_FCGI_END
@@ -20,26 +20,38 @@
 ****************************************************************************/
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <functional>
 #include <limits>
-#include <list>
 #include <map>
+#include <deque>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 extern "C" {
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <poll.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
 #include <assert.h>
 }
 
 #include <mosh/fcgi/exceptions.hpp>
 #include <mosh/fcgi/bits/block.hpp>
+#include <mosh/fcgi/bits/poller.hpp>
+#include <mosh/fcgi/bits/slab_pool.hpp>
 #include <mosh/fcgi/bits/types.hpp>
 #include <mosh/fcgi/protocol/types.hpp>
 #include <mosh/fcgi/protocol/full_id.hpp>
@@ -48,325 +60,826 @@ extern "C" {
 #include <mosh/fcgi/transceiver.hpp>
 #include <mosh/fcgi/bits/namespace.hpp>
 
-#include <src/array_deleter.hpp>
 #include <src/namespace.hpp>
 
 namespace {
 
-//! Predicate for comparing the file descriptor of a pollfd
-struct equals_fd : public std::unary_function<pollfd, bool> {
-	int fd;
-	explicit equals_fd(int fd): fd(fd) {}
-	bool operator()(const pollfd& x) const {
-		return x.fd == fd;
-	};
-};
+#ifdef IOV_MAX
+//! Maximum number of segments gathered into a single writev()
+const size_t max_iov = IOV_MAX;
+#else
+const size_t max_iov = _XOPEN_IOV_MAX;
+#endif
 
 }
 
 MOSH_FCGI_BEGIN
 
-//! %Buffer type for transmission of FastCGI records
+//! %Buffer type for transmission of FastCGI records to one connection
 /*!
- * This buffer is implemented as a circle of Chunk objects; the number of which can grow and shrink as needed. Write
+ * Every connection has a buffer of its own, so a connection that isn't taking data
+ * holds up nobody but itself. The buffer is a queue of Chunk objects; the number of which
+ * can grow and shrink as needed. Chunks are recycled through Transceiver::spare_chunks. Write
  * space is requested with request_write() which thereby returns a Block which may be smaller
  * than requested. The write is committed by calling secure_write(). A smaller space can be
  * committed than was given to write on.
  *
- * All data written to the buffer has an associated file descriptor through which it
- * is flushed. File descriptor association with data is managed through a queue of Frame
- * objects.
+ * The points after which the connection is to be closed, as well as file segments to be
+ * transmitted in between the buffered data, are tracked through a queue of Frame objects.
  */
 class Transceiver::Buffer {
-	//! %Frame of data associated with a file descriptor
+	//! %Frame of data
 	struct Frame {
 		//! Constructor
 		/*!
 		 * @param[in] size Size of the frame
 		 * @param[in] close_fd Boolean value indication whether or not the file descriptor should be closed when the frame has been flushed
-		 * @param[in] id Complete ID of the request making the frame
 		 */
-		Frame(size_t size, bool close_fd, protocol::Full_id id)
-			: size(size), close_fd(close_fd), id(id)
+		Frame(size_t size, bool close_fd)
+			: size(size), close_fd(close_fd), offset(0)
+		{ }
+		//! Constructor for a file segment
+		/*!
+		 * @param[in] size Size of the segment
+		 * @param[in] file File to transmit from
+		 * @param[in] offset Offset in the file of the segment
+		 */
+		Frame(size_t size, std::shared_ptr<File> file, off_t offset)
+			: size(size), close_fd(false), file(std::move(file)), offset(offset)
 		{ }
 		//! Size of the frame
 		size_t size;
 		//! Boolean value indication whether or not the file descriptor should be closed when the frame has been flushed
 		bool close_fd;
-		//! Complete ID (contains a file descriptor) of associated with the data frame
-		protocol::Full_id id;
+		//! File the frame is a segment of; null if the frame's data is in the chunks
+		std::shared_ptr<File> file;
+		//! Offset in file of the first byte not yet transmitted
+		off_t offset;
 	};
-	//! Queue of frames waiting to be transmitted
-	std::queue<Frame> frames;
+	/*! @brief Queue of frames waiting to be transmitted
+	 *
+	 * Consecutive frames in the chunks are merged, so a frame in the chunks either
+	 * is followed by a file segment, or has close_fd set, or is the last one.
+	 */
+	std::deque<Frame> frames;
 	//! Minimum Block size value that can be returned from request_write()
 	const static unsigned int min_block_size = 256;
-	//! A reference to Transceiver::poll_fds for removing file descriptors when they are closed
-	std::vector<pollfd>& poll_fds;
-	//! A reference to Transceiver::Fd_buffer for deleting buffers upon closing of the file descriptor
-	std::map<int, Fd_buffer>& fd_buffers;
+	//! Maximum number of chunks kept in Transceiver::spare_chunks
+	const static size_t max_spare_chunks = 16;
 	//! %Chunk of data in Buffer
 	struct Chunk {
 		//! Size of data section of the chunk
-		const static unsigned int size = 131072;
+		const static unsigned int size = 32768;
+		//! Takes ownership of data
+		Chunk(std::unique_ptr<uchar[]> data_): data(std::move(data_)), begin(data.get()), end(data.get()) { }
 		//! Pointer to the first byte in the chunk data
-		std::shared_ptr<uchar> data;
-		//! Pointer to the first write byte in the chunk or 1+ the last read byte
+		std::unique_ptr<uchar[]> data;
+		//! Pointer to the first byte not yet transmitted
+		uchar* begin;
+		//! Pointer to the first write byte in the chunk
 		uchar* end;
-		//! Creates a new data chunk
-		Chunk(): data(new uchar[size], SRC::Array_deleter<uchar>()), end(data.get()) { }
-		~Chunk() { }
-		//! Creates a new object that shares the data of the old one
-		Chunk(const Chunk& chunk): data(chunk.data), end(data.get()) { }
 	};
-	//! A list of chunks. Can contain from 2-infinity
-	std::list<Chunk> chunks;
-	//! Iterator pointing to the chunk currently used for writing
-	std::list<Chunk>::iterator write_it;
-	//! Current read spot in the buffer
-	uchar* p_read;
+	//! A queue of chunks. The last one is used for writing.
+	std::deque<Chunk> chunks;
+	//! A reference to Transceiver::spare_chunks
+	std::vector<std::unique_ptr<uchar[]>>& spare;
+	//! Number of bytes waiting to be transmitted
+	size_t pending;
+	//! Number of those bytes held in chunks
+	size_t buffered;
+
+	//! Number of bytes that can still be written to the last chunk
+	size_t room() const {
+		return chunks.back().data.get() + Chunk::size - chunks.back().end;
+	}
+	//! Drop the first chunk, keeping its memory around for reuse
+	void release_front() {
+		if (spare.size() < max_spare_chunks)
+			spare.push_back(std::move(chunks.front().data));
+		chunks.pop_front();
+	}
 public:
 	//! Constructor
 	/*!
-	 * @param[out] poll_fds A reference to Transceiver::poll_fds is needed for removing file descriptors when they are closed
-	 * @param[out] fd_buffers A reference to Transceiver::Fd_buffer is needed for deleting buffers upon closing of the file descriptor
+	 * @param[in,out] spare A reference to Transceiver::spare_chunks, to take chunks from and give them back to
 	 */
-	Buffer(std::vector<pollfd>& poll_fds, std::map<int, Fd_buffer>& fd_buffers)
-		: poll_fds(poll_fds), fd_buffers(fd_buffers), chunks(1), write_it(chunks.begin()), p_read(chunks.begin()->data.get())
+	Buffer(std::vector<std::unique_ptr<uchar[]>>& spare)
+		: spare(spare), pending(0), buffered(0)
 	{ }
+	~Buffer() {
+		while (!chunks.empty())
+			release_front();
+	}
 	//! Request a write block in the buffer
 	/*!
 	 * @param[in] size Requested size of write block
 	 * @return Block of writable memory. Size may be less than requested
 	 */
 	Block request_write(size_t size) {
-		return Block(write_it->end, std::min(size, (size_t)(write_it->data.get() + Chunk::size - write_it->end)));
+		if (chunks.empty() || room() < min_block_size) {
+			std::unique_ptr<uchar[]> data;
+			if (spare.empty())
+				data.reset(new uchar[Chunk::size]);
+			else {
+				data = std::move(spare.back());
+				spare.pop_back();
+			}
+			chunks.push_back(Chunk(std::move(data)));
+		}
+		return Block(chunks.back().end, std::min(size, room()));
 	}
 	//! Secure a write in the buffer
 	/*!
 	 * @param[in] size Amount of bytes to secure
-	 * @param[in] id Associated complete ID (contains file descriptor)
 	 * @param[in] kill Boolean value indicating whether or not the file descriptor should be closed after transmission
 	 */
-	void secure_write(size_t size, protocol::Full_id id, bool kill);
-		//! %Block of memory for extraction from Buffer
-	struct Send_block {
-		//! Constructor
-		/*!
-		 * @param[in] data Pointer to the first byte in the block
-		 * @param[in] size Size in bytes of the data
-		 * @param[in] fd File descriptor the data should be written to
-		 */
-		Send_block(const uchar* data, size_t size, int fd): data(data), size(size), fd(fd) { }
-		//! Create a new object that shares the data of the old
-		Send_block(const Send_block& send_block): data(send_block.data), size(send_block.size), fd(send_block.fd) { }
-		//! Pointer to the first byte in the block
-		const uchar* data;
-		//! Size in bytes of the data
-		size_t size;
-		//! File descriptor the data should be written to
-		int fd;
-	};
-	//! Request a block of data for transmitting
-	/*!
-	 * @return A block of data with a file descriptor to transmit it out
+	void secure_write(size_t size, bool kill) {
+		chunks.back().end += size;
+		pending += size;
+		buffered += size;
+		// Frames only need to be told apart where the connection gets closed or a file is sent
+		if (!frames.empty() && !frames.back().close_fd && !frames.back().file) {
+			frames.back().size += size;
+			frames.back().close_fd = kill;
+		} else
+			frames.push_back(Frame(size, kill));
+	}
+	/*! @brief Queue a file segment
+	 * @param[in] file File to transmit from
+	 * @param[in] offset Offset in the file of the segment
+	 * @param[in] size Size of the segment
+	 */
+	void secure_file(std::shared_ptr<File> file, off_t offset, size_t size) {
+		pending += size;
+		frames.push_back(Frame(size, std::move(file), offset));
+	}
+	/*! @brief Request the file segment at the front of the queue for transmitting
+	 * @param[out] file File descriptor of the file
+	 * @param[out] offset Offset in the file to transmit from
+	 * @param[out] size Size of what remains of the segment
+	 * @return false if the front of the queue isn't a file segment
 	 */
-	Send_block request_read() {
-		return Send_block(p_read, frames.empty() ? 0 : frames.front().size, frames.empty() ? -1 : frames.front().id.fd);
+	bool request_file(int& file, off_t& offset, size_t& size) const {
+		if (frames.empty() || !frames.front().file)
+			return false;
+		file = frames.front().file->get();
+		offset = frames.front().offset;
+		size = frames.front().size;
+		return true;
 	}
-	//! Mark data in the buffer as transmitted and free it's memory
+	/*! @brief Request data in the chunks for transmitting
+	 *
+	 * Gathers the data up to the first frame after which the connection is to be closed
+	 * or a file segment is to be sent, so it can be transmitted with a single writev().
+	 *
+	 * @param[out] iov Segments to transmit
+	 * @param[in] max Maximum number of segments to fill in
+	 * @param[out] size Total size in bytes of the segments
+	 * @return Number of segments filled in
+	 */
+	size_t request_read(iovec* iov, size_t max, size_t& size);
+	//! Mark data in the buffer as transmitted and free its memory
 	/*!
 	 * @param size Amount of bytes to mark as transmitted and free
+	 * @return true if the file descriptor is to be closed now
 	 */
-	void free_read(size_t size);
+	bool free_read(size_t size);
 	//! Test of the buffer is empty
 	/*!
 	 * @return true if the buffer is empty
 	 */
-	bool empty() {
-		return p_read == write_it->end;
+	bool empty() const {
+		return !pending;
+	}
+	//! Number of bytes held in memory; file segments aren't counted
+	size_t size() const {
+		return buffered;
 	}
 };
 
-Block Transceiver::request_write(size_t size) {
-	return pbuf->request_write(size);
+Transceiver::Connection::Connection() : blocked(false), queued(false), paused(false), interest(POLLIN | POLLHUP) { }
+
+Transceiver::Connection::~Connection() { }
+
+Transceiver::Connection::Connection(Connection&&) = default;
+
+Transceiver::Connection& Transceiver::Connection::operator = (Connection&&) = default;
+
+Block Transceiver::request_write(size_t size, protocol::Full_id id) {
+	// Handed over to secure_write() with the block; let go of if anything throws first
+	std::unique_lock<std::recursive_mutex> lock(state_lock);
+	auto it = connections.find(id.fd);
+	if (it == connections.end()) {
+		// The other side has hung up; whatever gets written is thrown away
+		if (discard.size() < size)
+			discard.resize(size);
+		Block block(discard.data(), size);
+		block.lock = std::move(lock);
+		return block;
+	}
+	Connection& connection = it->second;
+	if (!connection.out)
+		connection.out.reset(new Buffer(spare_chunks));
+	Block block(connection.out->request_write(size));
+	block.lock = std::move(lock);
+	return block;
+}
+
+void Transceiver::secure_write(Block& block, size_t size, protocol::Full_id id, bool kill) {
+	std::unique_lock<std::recursive_mutex> guard(std::move(block.lock));
+	auto it = connections.find(id.fd);
+	// Hung up on; the descriptor is closed by request_over(), as its number may belong to another connection by now
+	if (it == connections.end())
+		return;
+	Connection& connection = it->second;
+	connection.out->secure_write(size, kill);
+	if (high_water && !connection.paused && connection.out->size() > high_water) {
+		// Stop taking in more work from the other side until it has taken our output
+		connection.paused = true;
+		update_interest(id.fd, connection);
+	}
+	if (!connection.blocked)
+		transmit_soon(id.fd, connection);
+}
+
+void Transceiver::transmit_soon(int fd, Connection& connection) {
+	if (std::this_thread::get_id() != io_thread) {
+		schedule(fd, connection);
+		if (parked) {
+			parked = false;
+			wake();
+		}
+	} else if (dispatching)
+		// Flushing might drop the connection, which mustn't happen under parse_records()
+		schedule(fd, connection);
+	else
+		flush(fd, connection);
+}
+
+void Transceiver::throttle(protocol::Full_id id, Cancel_token const* cancellation) {
+	std::unique_lock<std::recursive_mutex> guard(state_lock);
+	// Output of a cancelled request is dropped anyway; waiting for it to drain is no use
+	auto cancelled = [cancellation] { return cancellation && cancellation->cancelled(); };
+	auto it = connections.find(id.fd);
+	if (!high_water || it == connections.end() || !it->second.out || it->second.out->size() <= high_water)
+		return;
+	if (std::this_thread::get_id() != io_thread) {
+		// Leave the flushing to handler(), and time out if it gets nowhere
+		while (it != connections.end() && it->second.out->size() > low_water && !cancelled()) {
+			size_t before = it->second.out->size();
+			if (send_timeout < 0)
+				drained.wait(guard);
+			else if (drained.wait_for(guard, std::chrono::milliseconds(send_timeout)) == std::cv_status::timeout) {
+				it = connections.find(id.fd);
+				if (it != connections.end() && it->second.out->size() >= before && !cancelled()) {
+					// handler() will find the connection hung up on
+					shutdown(id.fd, SHUT_RDWR);
+					return;
+				}
+			}
+			it = connections.find(id.fd);
+		}
+		return;
+	}
+	// Waiting here would stall every other connection, so only what the socket takes right
+	// away goes out; handler() sends the rest as the other side makes room for it
+	while (it != connections.end() && !it->second.blocked && it->second.out->size() > low_water && !cancelled()) {
+		size_t before = it->second.out->size();
+		flush(id.fd, it->second);
+		it = connections.find(id.fd);
+		if (it != connections.end() && it->second.out->size() >= before)
+			break;
+	}
+}
+
+size_t Transceiver::buffered() const {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	size_t total = 0;
+	for (auto const& connection : connections)
+		if (connection.second.out)
+			total += connection.second.out->size();
+	return total;
+}
+
+size_t Transceiver::buffered(int fd) const {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	auto it = connections.find(fd);
+	return it != connections.end() && it->second.out ? it->second.out->size() : 0;
+}
+
+void Transceiver::cancelled_throttle() {
+	// Under the lock, so a waiter can't miss it between testing its token and waiting
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	drained.notify_all();
+}
+
+bool Transceiver::when_drained(protocol::Full_id id, std::function<void()> f) {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	auto it = connections.find(id.fd);
+	if (it == connections.end() || !it->second.out || it->second.out->size() <= low_water)
+		return true;
+	it->second.drain_waiters.push_back(std::move(f));
+	return false;
+}
+
+void Transceiver::notify_drained(Connection& connection) {
+	std::vector<std::function<void()>> waiters;
+	waiters.swap(connection.drain_waiters);
+	for (auto& f : waiters)
+		f();
+}
+
+void Transceiver::secure_file(Block& header, size_t header_size, std::shared_ptr<File> file, off_t offset, size_t size,
+		size_t padding, protocol::Full_id id) {
+	// The record goes in whole, under the lock request_write() took for the header
+	std::unique_lock<std::recursive_mutex> guard(std::move(header.lock));
+	auto it = connections.find(id.fd);
+	if (it == connections.end())
+		return;
+	Connection& connection = it->second;
+	connection.out->secure_write(header_size, false);
+	if (size)
+		connection.out->secure_file(std::move(file), offset, size);
+	if (padding) {
+		Block block(connection.out->request_write(padding));
+		std::memset(block.data, 0, padding);
+		connection.out->secure_write(padding, false);
+	}
+	if (!connection.blocked)
+		transmit_soon(id.fd, connection);
 }
 
-void Transceiver::secure_write(size_t size, protocol::Full_id id, bool kill) {
-	pbuf->secure_write(size, id, kill);
-	transmit();
+Transceiver::File::~File() {
+	close(fd);
+}
+
+bool Transceiver::empty() const {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	for (auto const& connection : connections)
+		if (connection.second.out && !connection.second.out->empty())
+			return false;
+	return true;
 }
 
 void Transceiver::sleep() {
-	poll(&poll_fds.front(), poll_fds.size(), -1);
+	{
+		std::lock_guard<std::recursive_mutex> guard(state_lock);
+		// Output secured by another thread since handler() last ran
+		if (!writable.empty())
+			return;
+		parked = true;
+	}
+	if (events.empty())
+		poller->wait(events, -1);
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	parked = false;
 }
 
 void Transceiver::wake() {
-	char x;
-	ssize_t _unused = write(wakeup_fd_out, &x, 1);
+	// Only async-signal-safe calls in here; signal handlers call this
+#ifdef __linux__
+	uint64_t x = 1;
+#else
+	char x = 0;
+#endif
+	ssize_t _unused = write(wakeup_fd_out, &x, sizeof(x));
 	_unused = _unused;
 }
 
 int Transceiver::transmit() {
-	for(;;) {
-		Buffer::Send_block send_block(pbuf->request_read());
-		if (send_block.size) {
-			ssize_t sent = write(send_block.fd, send_block.data, send_block.size);
-			if (sent < 0) {
-				if (errno == EPIPE) {
-					poll_fds.erase(std::find_if(poll_fds.begin(), poll_fds.end(), equals_fd(send_block.fd)));
-					fd_buffers.erase(send_block.fd);
-					sent = send_block.size;
-				} else if (errno != EAGAIN)
-					throw exceptions::Socket_write(send_block.fd, errno);
-			}
-			pbuf->free_read(sent);
-			assert (send_block.size <= std::numeric_limits<ssize_t>::max()); 
-			if (sent != send_block.size)
-				break;
+	// Connections relisted by flush() wait for the next round
+	for (size_t n = writable.size(); n; --n) {
+		int fd = writable.front();
+		writable.pop_front();
+		auto it = connections.find(fd);
+		if (it == connections.end())
+			continue;
+		it->second.queued = false;
+		flush(fd, it->second);
+	}
+	return writable.empty();
+}
+
+void Transceiver::flush(int fd, Connection& connection) {
+	size_t size;
+	ssize_t sent;
+	int file;
+	off_t offset;
+	if (connection.out->request_file(file, offset, size)) {
+		sent = send_file(fd, file, offset, size);
+		if (sent == 0 || (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+					&& errno != EPIPE && errno != ECONNRESET)) {
+			// The file came up short, so the record framing it can't be completed
+			close_connection(fd);
+			return;
+		}
+	} else {
+		iovec iov[max_iov];
+		size_t n = connection.out->request_read(iov, max_iov, size);
+		if (!n)
+			return;
+		assert (size <= static_cast<size_t>(std::numeric_limits<ssize_t>::max()));
+		sent = writev(fd, iov, n);
+	}
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			wait_writable(fd, connection);
+		else if (errno == EINTR)
+			schedule(fd, connection);
+		else if (errno == EPIPE || errno == ECONNRESET) {
+			// Nobody is listening any more, so consider it sent
+			if (connection.out->free_read(size))
+				close_connection(fd);
+			else
+				hang_up(fd);
 		} else
-			break;
+			throw exceptions::Socket_write(fd, errno);
+		return;
+	}
+	if (connection.out->free_read(sent)) {
+		close_connection(fd);
+		return;
 	}
-	return pbuf->empty();
+	if (connection.out->size() <= low_water) {
+		if (connection.paused) {
+			connection.paused = false;
+			drained.notify_all();
+		}
+		notify_drained(connection);
+	}
+	if (!connection.out->empty()) {
+		if (static_cast<size_t>(sent) < size)
+			// A short write means the socket is full
+			connection.blocked = true;
+		else
+			schedule(fd, connection);
+	}
+	// Also picks up a pause made by another thread
+	update_interest(fd, connection);
 }
 
-void Transceiver::Buffer::secure_write(size_t size, protocol::Full_id id, bool kill) {
-	write_it->end += size;
-	if (min_block_size > (write_it->data.get() + Chunk::size - write_it->end) && ++write_it == chunks.end()) {
-		chunks.push_back(Chunk());
-		--write_it;
+ssize_t Transceiver::send_file(int fd, int file, off_t offset, size_t size) {
+#ifdef __linux__
+	return sendfile(fd, file, &offset, size);
+#else
+	uchar buffer[16384];
+	ssize_t actual = pread(file, buffer, std::min(size, sizeof(buffer)), offset);
+	if (actual <= 0)
+		return actual;
+	return write(fd, buffer, actual);
+#endif
+}
+
+void Transceiver::schedule(int fd, Connection& connection) {
+	if (!connection.queued) {
+		connection.queued = true;
+		writable.push_back(fd);
 	}
-	frames.push(Frame(size, kill, id));
 }
 
-bool Transceiver::handler() {
-	using namespace std;
-	using namespace protocol;
+void Transceiver::wait_writable(int fd, Connection& connection) {
+	connection.blocked = true;
+	update_interest(fd, connection);
+}
 
-	bool transmit_empty = transmit();
+void Transceiver::update_interest(int fd, Connection& connection) {
+	short interest = POLLHUP | (connection.paused ? 0 : POLLIN) | (connection.blocked ? POLLOUT : 0);
+	if (interest != connection.interest && std::this_thread::get_id() == io_thread) {
+		connection.interest = interest;
+		poller->modify(fd, interest, true);
+	}
+}
+
+void Transceiver::writable_again(int fd) {
+	auto it = connections.find(fd);
+	if (it == connections.end() || !it->second.blocked)
+		return;
+	it->second.blocked = false;
+	update_interest(fd, it->second);
+	schedule(fd, it->second);
+}
 
-	int ret_val = poll(&poll_fds.front(), poll_fds.size(), 0);
-	if (ret_val == 0) {
-		return (transmit_empty);
+size_t Transceiver::Buffer::request_read(iovec* iov, size_t max, size_t& size) {
+	size = 0;
+	if (frames.empty())
+		return 0;
+	size_t limit = frames.front().size;
+
+	size_t n = 0;
+	for (auto const& chunk : chunks) {
+		if (!limit || n == max)
+			break;
+		size_t len = std::min(limit, static_cast<size_t>(chunk.end - chunk.begin));
+		if (!len)
+			continue;
+		iov[n].iov_base = chunk.begin;
+		iov[n].iov_len = len;
+		++n;
+		size += len;
+		limit -= len;
 	}
-	if (ret_val < 0)
-		throw exceptions::Poll(errno);
+	return n;
+}
 
-	vector<pollfd>::iterator poll_fd = find_if(poll_fds.begin(), poll_fds.end(),
-							[](const pollfd& x) { return !!(x.revents); });
+bool Transceiver::handler() {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	io_thread = std::this_thread::get_id();
+	bool transmit_empty = transmit();
 
-	if (poll_fd->revents & POLLHUP) {
-		fd_buffers.erase(poll_fd->fd);
-		poll_fds.erase(poll_fd);
-		return false;
+	if (events.empty() && poller->wait(events, 0) == 0)
+		return transmit_empty;
+
+	// Service every ready file descriptor, not just the first one
+	std::vector<Poller::Event> ready;
+	ready.swap(events);
+	for (auto const& e : ready) {
+		if (e.fd == socket)
+			accept_connections();
+		else if (e.fd == wakeup_fd_in) {
+			// Reading an eventfd resets it; the socket pair is drained instead
+			uchar x[64];
+			while (read(wakeup_fd_in, x, sizeof(x)) == sizeof(x) && wakeup_fd_in != wakeup_fd_out)
+				;
+		} else {
+			if (e.events & POLLOUT)
+				writable_again(e.fd);
+			receive(e.fd, e.events);
+		}
 	}
+	return false;
+}
 
-	int fd = poll_fd->fd;
-	if (fd == socket) {
+void Transceiver::accept_connections() {
+	// The listener is level-triggered, so anything left over past the cap is reported again
+	for (size_t n = 0; n < accept_cap; ++n) {
+		if (max_conns && connections.size() >= max_conns) {
+			update_accepting();
+			return;
+		}
 		sockaddr_un addr;
 		socklen_t addrlen = sizeof(sockaddr_un);
-		fd = accept(fd, reinterpret_cast<sockaddr*>(&addr), &addrlen);
-		fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL) | O_NONBLOCK) ^ O_NONBLOCK);
-
-		poll_fds.push_back(pollfd());
-		poll_fds.back().fd = fd;
-		poll_fds.back().events = POLLIN | POLLHUP;
-
-		Message& message_buffer = fd_buffers[fd].message_buffer;
-		message_buffer.size = 0;
-		message_buffer.type = 0;
-	} else if (fd == wakeup_fd_in) {
-		char x;
-		ssize_t r = read(wakeup_fd_in, &x, 1);
-		r = r;
-		return false;
-	}
-
-	Message& message_buffer = fd_buffers[fd].message_buffer;
-	Header& header_buffer = fd_buffers[fd].header_buffer;
-
-	ssize_t actual;
-	// Are we in the process of recieving some part of a frame?
-	if (!message_buffer.data) {
-		// Are we recieving a partial header or new?
-		actual = read(fd, reinterpret_cast<uchar*>(&header_buffer) + message_buffer.size,
-					sizeof(Header) - message_buffer.size);
-		if (actual < 0 && errno != EAGAIN)
-			throw exceptions::Socket_read(fd, errno);
-		if (actual > 0)
-			message_buffer.size += actual;
-		if (message_buffer.size != sizeof(Header)) {
-			return (transmit_empty);
+#ifdef SOCK_NONBLOCK
+		int fd = accept4(socket, reinterpret_cast<sockaddr*>(&addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		int fd = accept(socket, reinterpret_cast<sockaddr*>(&addr), &addrlen);
+		if (fd >= 0) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// EAGAIN means the backlog is empty; anything else will be retried on the next wakeup
+			return;
 		}
 
-		message_buffer.data.reset(new uchar[sizeof(Header)
-						   + header_buffer.content_length()
-						   + header_buffer.padding_length()
-						  ]);
-		// we can't make assumptions about message_buffer.data's alignment, so memcpy() is used to safely copy the POD
-		memcpy(static_cast<void*>(message_buffer.data.get()), static_cast<const void*>(&header_buffer), sizeof(Header));
-	}
-	aligned<8, Header> _header(static_cast<void*>(message_buffer.data.get()));
-	Header& header = _header;
-	size_t needed = header.content_length() + header.padding_length() + sizeof(Header) - message_buffer.size;
-	assert(needed <= std::numeric_limits<ssize_t>::max()); // Send a bug report if this assertion fails
-	actual = read(fd, static_cast<uchar*>(message_buffer.data.get()) + message_buffer.size, needed);
-	if (actual < 0 && errno != EAGAIN)
-		throw exceptions::Socket_read(fd, errno);
-	if (actual > 0)
-		message_buffer.size += actual;
-
-	// Did we recieve a full frame?
-	if (actual == needed) {
-		send_message(Full_id(header_buffer.request_id(), fd), message_buffer);
-		message_buffer.size = 0;
-		message_buffer.data.reset();
-		return false;
-	}
-	return (transmit_empty);
-}
-
-void Transceiver::Buffer::free_read(size_t size) {
-	p_read += size;
-	if (p_read >= chunks.begin()->end) {
-		if (write_it == chunks.begin()) {
-			p_read = write_it->data.get();
-			write_it->end = p_read;
-		} else {
-			if (write_it == --chunks.end()) {
-				chunks.begin()->end = chunks.begin()->data.get();
-				chunks.splice(chunks.end(), chunks, chunks.begin());
-			} else
-				chunks.pop_front();
-			p_read = chunks.begin()->data.get();
+		poller->add(fd, POLLIN | POLLHUP, true);
+		connections[fd] = Connection();
+	}
+}
+
+void Transceiver::hang_up(int fd) {
+	auto it = connections.find(fd);
+	// Not ours any more; the descriptor may have been closed and reused already
+	if (it == connections.end())
+		return;
+	poller->remove(fd);
+	notify_drained(it->second);
+	connections.erase(it);
+	if (in_use && in_use(fd))
+		orphans.insert(fd);
+	else {
+		close(fd);
+		// Events already harvested for it are stale, as the descriptor may be reused
+		events.erase(std::remove_if(events.begin(), events.end(), [fd] (Poller::Event const& e) { return e.fd == fd; }),
+				events.end());
+	}
+	update_accepting();
+	drained.notify_all();
+}
+
+void Transceiver::request_over(int fd) {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	auto it = orphans.find(fd);
+	if (it == orphans.end() || in_use(fd))
+		return;
+	orphans.erase(it);
+	close(fd);
+}
+
+void Transceiver::close_connection(int fd) {
+	poller->remove(fd);
+	close(fd);
+	auto it = connections.find(fd);
+	if (it != connections.end()) {
+		notify_drained(it->second);
+		connections.erase(it);
+	}
+	update_accepting();
+	drained.notify_all();
+}
+
+void Transceiver::update_accepting() {
+	bool room = listening && (!max_conns || connections.size() < max_conns);
+	if (room != accepting) {
+		accepting = room;
+		poller->modify(socket, accepting ? POLLIN | POLLHUP : 0);
+	}
+}
+
+void Transceiver::stop_accepting() {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	listening = false;
+	update_accepting();
+}
+
+std::vector<int> Transceiver::idle_connections() const {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	std::vector<int> res;
+	for (auto const& c : connections)
+		if (c.second.in.begin == c.second.in.end && (!c.second.out || c.second.out->empty()))
+			res.push_back(c.first);
+	return res;
+}
+
+void Transceiver::release(int fd) {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	auto it = connections.find(fd);
+	if (it == connections.end())
+		return;
+	poller->remove(fd);
+	notify_drained(it->second);
+	connections.erase(it);
+	// Events already harvested for it are stale, as the descriptor may be reused
+	events.erase(std::remove_if(events.begin(), events.end(), [fd] (Poller::Event const& e) { return e.fd == fd; }),
+			events.end());
+	update_accepting();
+	drained.notify_all();
+}
+
+void Transceiver::adopt(int fd) {
+	std::lock_guard<std::recursive_mutex> guard(state_lock);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	poller->add(fd, POLLIN | POLLHUP, true);
+	connections[fd] = Connection();
+	update_accepting();
+}
+
+void Transceiver::receive(int fd, short revents) {
+	if (!(revents & POLLIN)) {
+		if (revents & (POLLHUP | POLLERR))
+			hang_up(fd);
+		return;
+	}
+
+	auto it = connections.find(fd);
+	if (it == connections.end())
+		return;
+	Fd_buffer& buffer = it->second.in;
+
+	// Drain the socket; an edge-triggered poller won't tell us about leftovers
+	for (;;) {
+		size_t room = reserve_read(buffer);
+		ssize_t actual = read(fd, buffer.data.get() + buffer.end, room);
+		if (actual < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			if (errno == ECONNRESET)
+				break;
+			throw exceptions::Socket_read(fd, errno);
 		}
+		if (actual == 0)
+			break;
+		buffer.end += actual;
+		parse_records(fd, buffer);
+		// A short read means the socket has been emptied
+		if (static_cast<size_t>(actual) < room)
+			return;
+	}
+	hang_up(fd);
+}
+
+size_t Transceiver::reserve_read(Fd_buffer& buffer) {
+	using namespace protocol;
+
+	size_t pending = buffer.end - buffer.begin;
+	size_t wanted = read_buffer_size;
+	if (pending >= sizeof(Header)) {
+		aligned<8, Header> _header(static_cast<const void*>(buffer.data.get() + buffer.begin));
+		Header& header = _header;
+		wanted = std::max(wanted, sizeof(Header) + header.content_length() + header.padding_length());
 	}
-	if ((frames.front().size -= size) == 0) {
-		if (frames.front().close_fd) {
-			poll_fds.erase(std::find_if(poll_fds.begin(), poll_fds.end(), equals_fd(frames.front().id.fd)));
-			close(frames.front().id.fd);
-			fd_buffers.erase(frames.front().id.fd);
+
+	if (buffer.data && buffer.data.use_count() == 1 && buffer.capacity >= wanted) {
+		// Nobody else is looking at the buffer, so it can be reused in place
+		if (buffer.begin) {
+			memmove(buffer.data.get(), buffer.data.get() + buffer.begin, pending);
+			buffer.begin = 0;
+			buffer.end = pending;
 		}
-		frames.pop();
+	} else if (!buffer.data || buffer.capacity - buffer.begin < wanted || buffer.end == buffer.capacity) {
+		size_t capacity;
+		std::shared_ptr<uchar> data(Slab_pool::instance().allocate(wanted, capacity));
+		if (pending)
+			memcpy(data.get(), buffer.data.get() + buffer.begin, pending);
+		buffer.data = std::move(data);
+		buffer.capacity = capacity;
+		buffer.begin = 0;
+		buffer.end = pending;
 	}
+	return buffer.capacity - buffer.end;
+}
 
+void Transceiver::parse_records(int fd, Fd_buffer& buffer) {
+	using namespace protocol;
+
+	while (buffer.end - buffer.begin >= sizeof(Header)) {
+		aligned<8, Header> _header(static_cast<const void*>(buffer.data.get() + buffer.begin));
+		Header& header = _header;
+		size_t size = sizeof(Header) + header.content_length() + header.padding_length();
+		if (buffer.end - buffer.begin < size)
+			break;
+
+		Message message;
+		message.type = 0;
+		message.size = size;
+		// Shares ownership of the whole buffer while pointing at this record
+		message.data = std::shared_ptr<uchar>(buffer.data, buffer.data.get() + buffer.begin);
+		buffer.begin += size;
+		dispatching = true;
+		send_message(Full_id(header.request_id(), fd), message);
+		dispatching = false;
+	}
+	if (buffer.begin == buffer.end && buffer.data.use_count() == 1)
+		buffer.begin = buffer.end = 0;
 }
 
-Transceiver::Transceiver(int fd_, std::function<void(protocol::Full_id, protocol::Message)> send_message_)
-	: pbuf(new Buffer(poll_fds, fd_buffers)), send_message(send_message_), poll_fds(2), socket(fd_)  {
-	// Let's setup an in/out socket for waking up poll()
+bool Transceiver::Buffer::free_read(size_t size) {
+	pending -= size;
+	bool close_fd = false;
+	while (size) {
+		Frame& frame = frames.front();
+		size_t n = std::min(size, frame.size);
+		size -= n;
+		if (frame.file)
+			frame.offset += n;
+		else {
+			buffered -= n;
+			for (size_t left = n; left; ) {
+				Chunk& chunk = chunks.front();
+				size_t m = std::min(left, static_cast<size_t>(chunk.end - chunk.begin));
+				chunk.begin += m;
+				left -= m;
+				if (chunk.begin == chunk.end)
+					release_front();
+			}
+		}
+		if ((frame.size -= n) == 0) {
+			close_fd = frame.close_fd;
+			frames.pop_front();
+		}
+	}
+	return close_fd;
+}
+
+Transceiver::Transceiver(int fd_, std::function<void(protocol::Full_id, protocol::Message)> send_message_,
+		Options const& options, size_t max_conns_, std::function<bool(int)> in_use_)
+	: poller(Poller::create(options.backend)), send_message(send_message_), in_use(in_use_), socket(fd_),
+	read_buffer_size(options.read_buffer_size), accept_cap(options.accept_cap ? options.accept_cap : 1),
+	high_water(options.high_water), low_water(std::min(options.low_water ? options.low_water : options.high_water / 4, options.high_water)),
+	send_timeout(options.send_timeout), max_conns(max_conns_), accepting(true), listening(true), dispatching(false), parked(false) {
+	// Let's setup an in/out file descriptor for waking up poll()
+#ifdef __linux__
+	wakeup_fd_in = wakeup_fd_out = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd_in < 0)
+		throw exceptions::Poll(errno);
+#else
 	int soc_pair[2];
-	socketpair(AF_UNIX, SOCK_STREAM, 0, soc_pair);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, soc_pair) < 0)
+		throw exceptions::Poll(errno);
 	wakeup_fd_in = soc_pair[0];
-	fcntl(wakeup_fd_in, F_SETFL, (fcntl(wakeup_fd_in, F_GETFL) | O_NONBLOCK) ^ O_NONBLOCK);
 	wakeup_fd_out = soc_pair[1];
+	// A full socket pair already has a wakeup pending, so nobody needs to wait on it
+	for (int fd : soc_pair) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
 
-	fcntl(socket, F_SETFL, (fcntl(socket, F_GETFL) | O_NONBLOCK) ^ O_NONBLOCK);
-	poll_fds[0].events = POLLIN | POLLHUP;
-	poll_fds[0].fd = socket;
-	poll_fds[1].events = POLLIN | POLLHUP;
-	poll_fds[1].fd = wakeup_fd_in;
+	// The listener may be shared with other transceivers, which could win the race to accept()
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+	poller->add(socket, POLLIN | POLLHUP);
+	poller->add(wakeup_fd_in, POLLIN | POLLHUP);
 }
 
-Transceiver::~Transceiver() { }
+Transceiver::~Transceiver() {
+	for (int fd : orphans)
+		close(fd);
+	close(wakeup_fd_in);
+	if (wakeup_fd_out != wakeup_fd_in)
+		close(wakeup_fd_out);
+}
 
 MOSH_FCGI_END